@@ -0,0 +1,55 @@
+// Example extension: arithmetic on unary numbers
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+//
+// Numbers are chains `T`T..`Tx (see unlambda_ext.h).
+//
+//   ``$+mn  m + n Ts on the x of n
+//   ``$*mn  m * n Ts on the x of n
+//   `$pn    prints n in decimal and returns n
+//   ``$txy  `yx, also replacing ``s`k`sik, the same function in SKI
+
+#include <stdio.h>
+
+#include "../unlambda_ext.h"
+
+static const UnlambdaExt* api;
+
+static UnlCell* add(UnlCell* args[]) {
+  UnlCell *x, *y;
+  unsigned long m = api->number(args[0], &x);
+  unsigned long n = api->number(args[1], &y);
+  return api->make_number(m + n, y);
+}
+
+static UnlCell* mul(UnlCell* args[]) {
+  UnlCell *x, *y;
+  unsigned long m = api->number(args[0], &x);
+  unsigned long n = api->number(args[1], &y);
+  return api->make_number(m * n, y);
+}
+
+static UnlCell* print(UnlCell* args[]) {
+  UnlCell* x;
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lu", api->number(args[0], &x));
+  // The innermost application is evaluated first.
+  UnlCell* e = args[0];
+  for (char* p = buf; *p; p++)
+    e = api->apply(api->dot(*p), e);
+  return e;
+}
+
+static UnlCell* t(UnlCell* args[]) {
+  return api->apply(args[1], args[0]);
+}
+
+int unlambda_ext_init(const UnlambdaExt* ext) {
+  api = ext;
+  api->define('+', 2, add, NULL);
+  api->define('*', 2, mul, NULL);
+  api->define('p', 1, print, NULL);
+  api->define('t', 2, t, "``s`k`sik");
+  return UNLAMBDA_EXT_VERSION;
+}
@@ -0,0 +1,452 @@
+// Unlambda interpreter - evaluator template
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+
+// This file is included by unlambda.c once for every combination of the
+// FEATURE_* flags, each time with RUN_FEATURES defined to the combination,
+// to generate copies of the evaluator without the code for builtins that
+// the program does not use. A copy must only be used for programs that
+// cannot create the cells of its missing features.
+//
+// If PROFILE_APPLY(op, val) is defined, it is called for every application
+// (see tools/rulecheck.c).
+
+#define HAS_D (RUN_FEATURES & FEATURE_D)
+#define HAS_C (RUN_FEATURES & FEATURE_C)
+#define HAS_IO (RUN_FEATURES & FEATURE_IO)
+#define HAS_E (RUN_FEATURES & FEATURE_E)
+
+static RunStatus RUN_NAME(RUN_FEATURES)(RunState* st) {
+  Cell* val = st->val;
+  Cell* op = st->op;
+  Cell* task_val = st->task_val;
+  Cell* next_cont = st->next_cont;
+  CellType task = st->task;
+#if HAS_IO
+  int current_ch = st->current_ch;
+  Input* in = st->in;
+#endif
+  Output* out = st->out;
+  Cell* term;  // lambda term being evaluated, in environment env
+  Cell* env;
+  uint64_t tier1 = 0;  // tier-1 node evaluations, added to tier1_evals
+  uint64_t apps = 0;  // added to applications
+  RunStatus status = RUN_SUSPENDED;  // returned at suspend
+  // The nursery never moves, so its end is kept in a register rather than
+  // reloaded from memory after every store to a cell.
+  char* const eden_end = SURVIVORS;
+
+  if (op)
+    goto apply;
+  goto eval;
+
+  for (;;) {
+    switch (task) {
+    case EVAL_RIGHT:
+      // Evaluate `<val><task_val>.
+#if HAS_D
+      if (val->t == D) {
+        op = val;
+        val = task_val;
+        POPCONT;
+        goto apply;
+      } else
+#endif
+      {
+        Cell* rand = task_val;
+        task = APPLY;
+        task_val = val;
+        val = rand;
+        goto eval;
+      }
+    case EVAL_RIGHT_S:
+      // Evaluate `<val><task_val>, task_val is of the form `<v1><v2>
+      // where v1 and v2 are already evaluated.
+#if HAS_D
+      if (val->t == D) {
+        op = val;
+        val = task_val;
+        POPCONT;
+      } else
+#endif
+      {
+        Cell* rand = task_val;
+        task = APPLY;
+        task_val = val;
+        op = rand->l;
+        val = rand->r;
+      }
+      goto apply;
+    case APPLY:
+      // Apply `<task_val><val>.
+      op = task_val;
+      POPCONT;
+      goto apply;
+    case APPLY_T:
+      // Apply `<val><task_val>.
+      op = val;
+      val = task_val;
+      POPCONT;
+      goto apply;
+    case MEMO:
+      // The program node task_val has been forced to val.
+      memo_end(task_val, val);
+      POPCONT;
+      continue;
+    case EXIT:
+      st->val = val;  // the value of the program
+      tier1_evals += tier1;
+      applications += apps;
+      return RUN_EXIT;
+    default:
+      errexit("[BUG] run: invalid task type %d\n", task);
+    }
+    continue;
+  eval:
+    for (;;) {
+      if (free_ptr + LARGE_CELL_SIZE > eden_end) {
+        Cell* roots[3] = {val, task_val, next_cont};
+        gc_run(roots, 3);
+        val = roots[0];
+        task_val = roots[1];
+        next_cont = roots[2];
+        if (st->slice && apps >= st->slice) {
+          op = NULL;
+          status = RUN_YIELDED;
+          goto suspend;
+        }
+      }
+      if (val->t == AP) {
+        if (++node_counts[val->id] == tier_threshold) {
+          tier_up(val);
+          continue;
+        }
+        PUSHCONT(EVAL_RIGHT, val->r);
+        val = val->l;
+        continue;
+      }
+      if (is_value(val))
+        break;
+      if (val->t == TERM) {
+        term = val->l;
+        env = val->r;
+        goto teval;
+      }
+      if (val->t == HOLE) {
+        val = pipeline_wait(val, out);
+        continue;
+      }
+      if (val->t == LAZY) {
+        lazy_expand(val);
+        continue;
+      }
+      tier1++;
+      switch (val->t) {
+      case AP_DIRECT:
+        op = val->l;
+        val = val->r;
+        goto apply;
+      case AP_LEFT_VALUE:
+        PUSHCONT(APPLY, val->l);
+        val = val->r;
+        continue;
+      case AP_RIGHT_VALUE:
+        PUSHCONT(APPLY_T, val->r);
+        val = val->l;
+        continue;
+      default:
+        errexit("[BUG] eval: invalid expression type %d\n", val->t);
+      }
+    }
+    continue;
+  teval:
+    if (free_ptr + 2 * LARGE_CELL_SIZE > eden_end) {
+      // Terms are old cells, which only a major GC could sweep.
+      Cell* roots[4] = {task_val, next_cont, env, term};
+      gc_run(roots, 4);
+      task_val = roots[0];
+      next_cont = roots[1];
+      env = roots[2];
+      if (st->slice && apps >= st->slice) {
+        val = new_cell(TERM, term, env);
+        op = NULL;
+        status = RUN_YIELDED;
+        goto suspend;
+      }
+    }
+    switch (term->t) {
+    case LAPP:
+      {
+        Cell* rand = term->r;
+        if (rand->t == LAPP)
+          PUSHCONT(EVAL_RIGHT, new_cell(TERM, rand, env));
+        else if (rand->t == LAM)
+          PUSHCONT(APPLY_T, new_cell(CLOSURE, rand, env));
+        else if (rand->t == CONST)
+          PUSHCONT(APPLY_T, rand->l);
+        else {
+          Cell* e = env;
+          for (uint32_t i = rand->id; i; i--)
+            e = e->r;
+          PUSHCONT(APPLY_T, e->l);
+        }
+        term = term->l;
+        goto teval;
+      }
+    case VAR:
+      {
+        Cell* e = env;
+        for (uint32_t i = term->id; i; i--)
+          e = e->r;
+        val = e->l;
+        continue;
+      }
+    case CONST:
+      val = term->l;
+      continue;
+    case LAM:
+      val = new_cell(CLOSURE, term, env);
+      continue;
+    default:
+      errexit("[BUG] teval: invalid term type %d\n", term->t);
+    }
+  apply:
+    apps++;
+#ifdef PROFILE_APPLY
+    PROFILE_APPLY(op, val);
+#endif
+    if (free_ptr + 2 * LARGE_CELL_SIZE > eden_end) {
+      Cell* roots[4] = {val, task_val, next_cont, op};
+      gc_run(roots, 4);
+      val = roots[0];
+      task_val = roots[1];
+      next_cont = roots[2];
+      op = roots[3];
+      if (st->slice && apps >= st->slice) {
+        status = RUN_YIELDED;
+        goto suspend;
+      }
+    }
+    switch (op->t) {
+    case I:
+      break;
+    case DOT:
+      if (!output_putc(out, op->ch))
+        goto suspend;
+      effect_count++;
+      break;
+    case K1:
+      val = op->l;
+      break;
+    case K:
+      if (PENDING_ARG(task, task_val)) {
+        // ``k<val><y>: drop y.
+        POPCONT;
+        break;
+      }
+      val = new_cell1(K1, val);
+      break;
+    case S2:
+      {
+        Cell* e2 = new_ap(op->r, val);
+        PUSHCONT(EVAL_RIGHT_S, e2);
+        op = op->l;
+        goto apply;
+      }
+    case B2:
+#if HAS_D
+      if (op->l->t == D) {
+        Cell* e2 = new_ap(op->r, val);
+        val = new_cell1(D1, e2);
+        break;
+      }
+#endif
+      PUSHCONT(APPLY, op->l);
+      op = op->r;
+      goto apply;
+    case C2:
+      PUSHCONT(APPLY_T, op->r);
+      op = op->l;
+      goto apply;
+    case V2:
+      {
+        Cell* v = op->l;
+        PUSHCONT(APPLY_T, op->r);
+        op = val;
+        val = v;
+        goto apply;
+      }
+    case S1:
+      if (PENDING_ARG(task, task_val)) {
+        // ```s<x><val><z>
+        Cell* z = task_val;
+        task = EVAL_RIGHT_S;
+        task_val = new_ap(val, z);
+        op = op->l;
+        val = z;
+        goto apply;
+      }
+      val = (val->t == K1)
+        ? (op->l->t == I ? new_cell1(T1, val->l)
+           : op->l->t == T1 ? new_cell(V2, op->l->l, val->l)
+           : new_cell(C2, op->l, val->l))
+        : new_cell(S2, op->l, val);
+      break;
+    case B1:
+      if (PENDING_ARG(task, task_val)) {
+        // ```s`k<x><val><z>
+        Cell* z = task_val;
+#if HAS_D
+        if (op->l->t == D) {
+          val = new_cell1(D1, new_ap(val, z));
+          POPCONT;
+          break;
+        }
+#endif
+        task = APPLY;
+        task_val = op->l;
+        op = val;
+        val = z;
+        goto apply;
+      }
+      val = new_cell(B2, op->l, val);
+      break;
+    case T1:
+      {
+        Cell* v = op->l;
+        op = val;
+        val = v;
+        goto apply;
+      }
+    case TN:
+      {
+        Cell* v;
+        if (op->id == 2) {
+          v = new_cell1(T1, op->l);
+        } else {
+          v = new_cell1(TN, op->l);
+          v->id = op->id - 1;
+        }
+        op = val;
+        val = v;
+        goto apply;
+      }
+    case S:
+      if (PENDING_ARG(task, task_val) &&
+          PENDING_ARG(next_cont->t, next_cont->r)) {
+        // ```s<val><y><z>
+        Cell* x = val;
+        Cell* y = task_val;
+        POPCONT;
+        Cell* z = task_val;
+        task = EVAL_RIGHT_S;
+        task_val = new_ap(y, z);
+        op = x;
+        val = z;
+        goto apply;
+      }
+      val = (val->t == K1)
+        ? new_cell1(B1, val->l)
+        : new_cell1(S1, val);
+      break;
+    case V:
+      val = op;
+      break;
+    case EXT:
+      if (op->id + 1 < extensions[op->ch].arity) {
+        val = new_cell(EXT, op, val);
+        val->ch = op->ch;
+        val->id = op->id + 1;
+        break;
+      }
+      effect_count++;
+      val = ext_call(op, val);
+      goto eval;
+    case CLOSURE:
+      env = new_cell(ENV, val, op->r);
+      term = op->l->l;
+      goto teval;
+#if HAS_D
+    case D1:
+      PUSHCONT(APPLY_T, val);
+      val = op->l;
+      if (memo_slot && node_id(val)) {
+        Cell* v = memo_lookup(val);
+        if (v) {
+          memo_hits++;
+          val = v;
+          break;
+        }
+        memo_begin(val);
+        PUSHCONT(MEMO, val);
+      }
+      goto eval;
+    case D:
+      val = new_cell1(D1, val);
+      break;
+#endif
+#if HAS_C
+    case CONT:
+      effect_count++;
+      next_cont = op->l;
+      POPCONT;
+      break;
+    case C:
+      effect_count++;
+      PUSHCONT(APPLY, val);
+      val = new_cell1(CONT, next_cont);
+      break;
+#endif
+#if HAS_E
+    case E:
+      task = EXIT;
+      break;
+#endif
+#if HAS_IO
+    case AT:
+      current_ch = input_getc(in);
+      if (current_ch == INPUT_PENDING)
+        goto suspend;
+      effect_count++;
+      PUSHCONT(APPLY, val);
+      val = new_cell0(current_ch == EOF ? V : I);
+      break;
+    case QUES:
+      effect_count++;
+      PUSHCONT(APPLY, val);
+      val = new_cell0(current_ch == op->ch ? I : V);
+      break;
+    case PIPE:
+      effect_count++;
+      PUSHCONT(APPLY, val);
+      val = new_cell0(current_ch == EOF ? V : DOT);
+      val->ch = current_ch;
+      break;
+#endif
+    default:
+      errexit("[BUG] apply: invalid operator type %d\n", op->t);
+    }
+  }
+
+  // Applying op to val is retried when resumed, or evaluating val if op is
+  // NULL.
+suspend:
+  st->val = val;
+  st->op = op;
+  st->task_val = task_val;
+  st->next_cont = next_cont;
+  st->task = task;
+#if HAS_IO
+  st->current_ch = current_ch;
+#endif
+  tier1_evals += tier1;
+  applications += apps;
+  return status;
+}
+
+#undef HAS_D
+#undef HAS_C
+#undef HAS_IO
+#undef HAS_E
+#undef RUN_FEATURES
@@ -0,0 +1,58 @@
+// Generator of large programs for benchmarking the parser
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+//
+// Writes `d applied to a random tree of the given number of leaves, in
+// lines of 72 characters. The tree is never evaluated, so running the
+// program measures the parser (and the analyses done before running).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t seed = 88172645463325252ULL;
+static int column;
+
+static uint64_t next_random() {
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+static void put(const char* token) {
+  int len = strlen(token);
+  if (column + len > 72) {
+    putchar('\n');
+    column = 0;
+  }
+  fputs(token, stdout);
+  column += len;
+}
+
+static void tree(long leaves) {
+  static const char* const leaf[] = {"i", "k", "s", "v", "r", ".a", ".*", "?x", "@", "c"};
+  if (leaves == 1) {
+    put(leaf[next_random() % (sizeof(leaf) / sizeof(leaf[0]))]);
+    return;
+  }
+  long left = 1 + next_random() % (leaves - 1);
+  put("`");
+  tree(left);
+  tree(leaves - left);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s leaves [seed]\n", argv[0]);
+    return 1;
+  }
+  if (argc == 3)
+    seed += strtoull(argv[2], NULL, 10);
+  put("`d");
+  tree(atol(argv[1]));
+  putchar('\n');
+  return 0;
+}
@@ -0,0 +1,256 @@
+// Load generator for the --sessions mode of the Unlambda interpreter
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+//
+// Opens a number of concurrent connections to the session socket. Every
+// client waits for the prompt, sends the next line of the script, and
+// records the time until the response (up to the next prompt) has arrived.
+// Without a prompt, the latency is measured to the first response byte.
+// With a prompt, clients wait for the program's greeting (ending with the
+// prompt) before sending the first line, unless -n is given.
+//
+// With -o, what the first client receives is written to a file. With -s,
+// stalled clients also connect: they send the script over and over and
+// never read, so the server has output for them that it cannot write,
+// which must not hold up the other clients.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void errexit(char *fmt, ...) {
+  va_list arg;
+  va_start(arg, fmt);
+  vfprintf(stderr, fmt, arg);
+  va_end(arg);
+  exit(1);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  int fd;
+  int next_line;     // index of the line to send next
+  bool waiting;      // a request is in flight (or the greeting is awaited)
+  double sent_at;
+  char tail[64];     // last bytes received, to detect the prompt
+  size_t tail_len;
+} Client;
+
+static char** lines;
+static int nlines;
+static const char* prompt;
+
+static double* latencies;
+static long nlatencies, latencies_cap;
+
+static void record(double t) {
+  if (nlatencies == latencies_cap) {
+    latencies_cap = latencies_cap ? latencies_cap * 2 : 1024;
+    latencies = realloc(latencies, sizeof(double) * latencies_cap);
+    if (!latencies)
+      errexit("Out of memory\n");
+  }
+  latencies[nlatencies++] = t;
+}
+
+static void read_script(const char* fname) {
+  FILE* fp = fopen(fname, "r");
+  if (!fp)
+    errexit("cannot open %s\n", fname);
+  int cap = 64;
+  lines = malloc(sizeof(char*) * cap);
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), fp)) {
+    if (nlines == cap)
+      lines = realloc(lines, sizeof(char*) * (cap *= 2));
+    lines[nlines++] = strdup(buf);
+  }
+  fclose(fp);
+}
+
+static int connect_to(const char* path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    errexit("cannot connect to %s: %s\n", path, strerror(errno));
+  return fd;
+}
+
+// Returns true if the response to the current request is complete.
+static bool received(Client* c, const char* buf, size_t n) {
+  if (!prompt)
+    return true;
+  size_t plen = strlen(prompt);
+  for (size_t i = 0; i < n; i++) {
+    if (c->tail_len == sizeof(c->tail)) {
+      memmove(c->tail, c->tail + 1, sizeof(c->tail) - 1);
+      c->tail_len--;
+    }
+    c->tail[c->tail_len++] = buf[i];
+  }
+  return c->tail_len >= plen &&
+    memcmp(c->tail + c->tail_len - plen, prompt, plen) == 0;
+}
+
+static void send_next(Client* c) {
+  if (c->next_line == nlines) {
+    shutdown(c->fd, SHUT_WR);
+    return;
+  }
+  const char* line = lines[c->next_line++];
+  size_t len = strlen(line);
+  if (write(c->fd, line, len) != (ssize_t)len)
+    errexit("write failed\n");
+  c->tail_len = 0;
+  c->waiting = true;
+  c->sent_at = now();
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+  long i = (long)(p / 100.0 * (nlatencies - 1) + 0.5);
+  return latencies[i] * 1000.0;
+}
+
+// Sends as much of the script as the stalled connection takes.
+static void stall(int fd, int* next_line) {
+  for (;;) {
+    const char* line = lines[*next_line];
+    ssize_t n = write(fd, line, strlen(line));
+    if (n < 0)
+      return;
+    *next_line = (*next_line + 1) % nlines;
+  }
+}
+
+static void usage(const char* progname) {
+  fprintf(stderr, "Usage: %s [-c clients] [-s stalled] [-p prompt [-n]] [-o transcript] socket script\n",
+          progname);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  int nclients = 1, nstalled = 0;
+  bool greeting = true;
+  const char* transcript_file = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:np:o:s:")) != -1) {
+    switch (opt) {
+    case 'c': nclients = atoi(optarg); break;
+    case 'n': greeting = false; break;
+    case 'p': prompt = optarg; break;
+    case 'o': transcript_file = optarg; break;
+    case 's': nstalled = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || nclients < 1 || nstalled < 0)
+    usage(argv[0]);
+  const char* path = argv[optind];
+  read_script(argv[optind + 1]);
+  if (nstalled && !nlines)
+    errexit("stalled clients need a script\n");
+  FILE* transcript = NULL;
+  if (transcript_file && !(transcript = fopen(transcript_file, "w")))
+    errexit("cannot open %s\n", transcript_file);
+
+  Client* clients = calloc(nclients, sizeof(Client));
+  struct pollfd* fds = calloc(nclients + nstalled, sizeof(struct pollfd));
+  int* stalled = calloc(nstalled, sizeof(int));
+  int* stalled_line = calloc(nstalled, sizeof(int));
+  for (int i = 0; i < nstalled; i++) {
+    stalled[i] = connect_to(path);
+    fcntl(stalled[i], F_SETFL, fcntl(stalled[i], F_GETFL) | O_NONBLOCK);
+  }
+  double start = now();
+  for (int i = 0; i < nclients; i++) {
+    clients[i].fd = connect_to(path);
+    // With a prompt, wait for the greeting before sending the first line.
+    if (prompt && greeting)
+      clients[i].waiting = true;
+    else
+      send_next(&clients[i]);
+  }
+
+  int active = nclients;
+  while (active) {
+    for (int i = 0; i < nclients; i++) {
+      fds[i].fd = clients[i].fd;
+      fds[i].events = POLLIN;
+    }
+    for (int i = 0; i < nstalled; i++) {
+      fds[nclients + i].fd = stalled[i];
+      fds[nclients + i].events = POLLOUT;
+    }
+    if (poll(fds, nclients + nstalled, -1) < 0)
+      errexit("poll failed\n");
+    for (int i = 0; i < nstalled; i++) {
+      short revents = fds[nclients + i].revents;
+      if (revents & (POLLERR | POLLHUP)) {
+        close(stalled[i]);
+        stalled[i] = -1;  // ignored by poll
+      } else if (revents & POLLOUT) {
+        stall(stalled[i], &stalled_line[i]);
+      }
+    }
+    for (int i = 0; i < nclients; i++) {
+      Client* c = &clients[i];
+      if (c->fd < 0 || !fds[i].revents)
+        continue;
+      char buf[4096];
+      ssize_t n = read(c->fd, buf, sizeof(buf));
+      if (n <= 0) {
+        close(c->fd);
+        c->fd = -1;
+        active--;
+        continue;
+      }
+      if (i == 0 && transcript)
+        fwrite(buf, 1, n, transcript);
+      if (c->waiting && received(c, buf, n)) {
+        if (c->next_line > 0)
+          record(now() - c->sent_at);
+        c->waiting = false;
+        send_next(c);
+      }
+    }
+  }
+  double elapsed = now() - start;
+  if (transcript)
+    fclose(transcript);
+
+  if (nlatencies == 0)
+    errexit("no responses\n");
+  qsort(latencies, nlatencies, sizeof(double), compare_double);
+  printf("clients   %d\n", nclients);
+  printf("requests  %ld (%.1f/sec)\n", nlatencies, nlatencies / elapsed);
+  printf("p50       %.3f ms\n", percentile(50));
+  printf("p90       %.3f ms\n", percentile(90));
+  printf("p99       %.3f ms\n", percentile(99));
+  printf("max       %.3f ms\n", latencies[nlatencies - 1] * 1000.0);
+  return 0;
+}
@@ -0,0 +1,216 @@
+// Microbenchmarks of the reductions of the Unlambda interpreter
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+//
+// Measures one kind of reduction at a time with the interpreter's own
+// evaluator, which is included below. For every kind, a function f and an
+// argument a are built from cells such that `fa reduces back to f, and
+// run() evaluates the chain `..``fa a..a of STEP_CHAIN applications,
+// repeatedly. The operands are values, so apart from the reductions of the
+// kind, a step only costs the continuation of its operator. The "i" kind
+// measures that cost alone.
+//
+// Reported per step: the time (the best of several trials), the
+// applications done by run() and the bytes allocated in the eden. With -o,
+// the results are also appended to a CSV file, to track them over time.
+
+#define main unlambda_main
+#include "../unlambda.c"
+#undef main
+
+#define STEP_CHAIN 1000
+#define DEFAULT_STEPS 2000000
+#define TRIALS 5
+
+static Cell* old_ap(Cell* l, Cell* r) {
+  Cell* c = allocate_from_old(AP, l, r);
+  c->id = 0;  // not a program node
+  return c;
+}
+
+static Cell* old_cell(CellType t, Cell* l, Cell* r) {
+  return allocate_from_old(t, l, r);
+}
+
+typedef struct {
+  const char* name;
+  const char* reduction;  // what a step does
+  int features;
+  void (*build)(Cell** f, Cell** a);
+} Kind;
+
+static void build_i(Cell** f, Cell** a) {
+  *f = *a = old_cell(I, NULL, NULL);
+}
+
+static void build_k(Cell** f, Cell** a) {
+  *f = *a = old_cell(K, NULL, NULL);
+}
+
+static void build_s2(Cell** f, Cell** a) {
+  Cell* k = old_cell(K, NULL, NULL);
+  *f = *a = old_cell(S2, k, k);
+}
+
+static void build_b2(Cell** f, Cell** a) {
+  Cell* i = old_cell(I, NULL, NULL);
+  *f = *a = old_cell(B2, i, i);
+}
+
+static void build_c2(Cell** f, Cell** a) {
+  *f = *a = old_cell(C2, old_cell(K, NULL, NULL), old_cell(I, NULL, NULL));
+}
+
+static void build_t1(Cell** f, Cell** a) {
+  *f = old_cell(T1, NULL, NULL);
+  (*f)->l = *f;
+  *a = old_cell(I, NULL, NULL);
+}
+
+static void build_v2(Cell** f, Cell** a) {
+  *f = old_cell(V2, NULL, old_cell(I, NULL, NULL));
+  (*f)->l = *f;
+  *a = old_cell(K, NULL, NULL);
+}
+
+static void build_c(Cell** f, Cell** a) {
+  *f = old_cell(C, NULL, NULL);
+  *a = old_cell(T1, *f, NULL);
+}
+
+static void build_d(Cell** f, Cell** a) {
+  Cell* i = old_cell(I, NULL, NULL);
+  *f = *a = old_cell(D1, old_ap(i, i), NULL);
+}
+
+static const Kind kinds[] = {
+  {"i", "`ix -> x", 0, build_i},
+  {"k", "``kxy -> x", 0, build_k},
+  {"s2", "```skkx -> x", 0, build_s2},
+  {"b2", "```s`kiix -> x", 0, build_b2},
+  {"c2", "```sk`kix -> x", 0, build_c2},
+  {"t1", "`Tfi -> f, f = `Tf", 0, build_t1},
+  {"v2", "`Vfik -> f, f = `Vfi", 0, build_v2},
+  {"c", "`c`Tc -> c, capture and invoke", FEATURE_C, build_c},
+  {"d", "``d`iix -> x, force", FEATURE_D, build_d},
+};
+
+#define NUM_KINDS (sizeof(kinds) / sizeof(kinds[0]))
+
+typedef struct {
+  double ns;  // per step
+  double applications, bytes;
+} Result;
+
+static uint64_t young_allocated() {
+  return young_bytes + (free_ptr - EDEN);
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void measure(const Kind* kind, Cell* chain, long runs, Result* r) {
+  r->ns = 0;
+  for (int trial = 0; trial < TRIALS; trial++) {
+    uint64_t apps = applications, bytes = young_allocated();
+    double start = now();
+    for (long i = 0; i < runs; i++) {
+      RunState st;
+      run_init(&st, chain, kind->features, NULL, &stdout_output);
+      run(&st);
+    }
+    double ns = (now() - start) * 1e9 / (runs * STEP_CHAIN);
+    if (trial == 0 || ns < r->ns)
+      r->ns = ns;
+    r->applications = (double)(applications - apps) / (runs * STEP_CHAIN);
+    r->bytes = (double)(young_allocated() - bytes) / (runs * STEP_CHAIN);
+  }
+}
+
+static void usage(const char* progname) {
+  fprintf(stderr, "Usage: %s [-n steps] [-o results.csv [-l label]] [kind]...\n",
+          progname);
+  fprintf(stderr, "Kinds:");
+  for (size_t i = 0; i < NUM_KINDS; i++)
+    fprintf(stderr, " %s", kinds[i].name);
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  long steps = DEFAULT_STEPS;
+  const char* csv = NULL;
+  const char* label = "";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:o:l:")) != -1) {
+    switch (opt) {
+    case 'n': steps = atol(optarg); break;
+    case 'o': csv = optarg; break;
+    case 'l': label = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  bool selected[NUM_KINDS];
+  for (size_t i = 0; i < NUM_KINDS; i++)
+    selected[i] = optind == argc;
+  for (int i = optind; i < argc; i++) {
+    size_t k = 0;
+    while (k < NUM_KINDS && strcmp(argv[i], kinds[k].name))
+      k++;
+    if (k == NUM_KINDS)
+      usage(argv[0]);
+    selected[k] = true;
+  }
+  long runs = steps / STEP_CHAIN;
+  if (runs < 1)
+    usage(argv[0]);
+
+  // The chains are evaluated many times, so nodes must never tier up, and
+  // they must survive major GCs: they are frozen like the program of
+  // sessions.
+  storage_init();
+  tier_init();
+  tier_threshold = UINT32_MAX;
+  Cell* chains[NUM_KINDS];
+  for (size_t k = 0; k < NUM_KINDS; k++) {
+    Cell *f, *a;
+    kinds[k].build(&f, &a);
+    chains[k] = f;
+    for (int i = 0; i < STEP_CHAIN; i++)
+      chains[k] = old_ap(chains[k], a);
+  }
+  freeze_program(chains, NUM_KINDS);
+
+  FILE* fp = NULL;
+  char date[32];
+  if (csv) {
+    fp = fopen(csv, "a");
+    if (!fp)
+      errexit("cannot open %s\n", csv);
+    if (ftell(fp) == 0)
+      fprintf(fp, "date,label,kind,ns_per_step,applications_per_step,bytes_per_step\n");
+    time_t t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+  }
+
+  printf("%-4s %-34s %9s %9s %9s\n", "kind", "step", "ns", "apps", "bytes");
+  for (size_t k = 0; k < NUM_KINDS; k++) {
+    if (!selected[k])
+      continue;
+    Result r;
+    measure(&kinds[k], chains[k], runs, &r);
+    printf("%-4s %-34s %9.2f %9.2f %9.1f\n", kinds[k].name, kinds[k].reduction,
+           r.ns, r.applications, r.bytes);
+    if (fp) {
+      fprintf(fp, "%s,%s,%s,%.3f,%.3f,%.1f\n", date, label, kinds[k].name,
+              r.ns, r.applications, r.bytes);
+    }
+  }
+  if (fp)
+    fclose(fp);
+  return 0;
+}
@@ -0,0 +1,511 @@
+// Equivalence checker of rewrite rules for the Unlambda interpreter
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+//
+// Checks candidate rules such as ```s`kfgx = `f`gx (the B combinator of
+// run()) with the interpreter's own evaluator, which is included below.
+//
+// A rule is a line "name lhs = rhs", where lowercase letters other than the
+// builtins are variables, standing for values (run() rewrites registers,
+// never unevaluated operands). Every variable is instantiated with each of
+//
+//   a probe   $x, a native combinator that only collects its arguments
+//   i k s v d the builtins that run() has to treat specially
+//   .X        an effect, printing the name of the variable
+//
+// and both sides are evaluated, then applied to fresh probes until their
+// values are applications of probes (or MAX_EXTRA probes are applied).
+// They are also applied to the unevaluated operand `.*i first, which a
+// value such as d must not evaluate. The rule holds if the outputs after
+// every number of probes and the final values, printed in SKI form, are
+// the same. This is exhaustive testing, not a proof; rules that
+// diverge for some instantiation make the checker diverge too.
+//
+// With benchmarks (-b prog.unl[:input]), the programs are run first with a
+// profile of the operator and argument types of every application, and
+// the savings of a rule are estimated from the number of applications of
+// its trigger, the last application of its lhs where neither side is a
+// probe (for B, s applied to `kf).
+
+#include <stdarg.h>
+
+#define main unlambda_main
+#define PROFILE_APPLY(op, val) profile_apply((op)->t, (val)->t)
+static void profile_apply(int op, int arg);
+#include "../unlambda.c"
+#undef main
+
+#define MAX_EXTRA 4  // fresh probes applied to the values of the sides
+#define EFFECT_ARG "`.*i"  // an operand whose evaluation prints *
+#define MAX_VARS 8
+
+static const char* const type_names[] = {
+  "I", "DOT", "K1", "K", "S2", "B2", "C2", "V2", "S1", "B1", "T1", "S", "V",
+  "D1", "D", "CONT", "C", "E", "AT", "QUES", "PIPE", "CLOSURE", "TN", "EXT",
+};
+
+static uint64_t profile[EXT + 1][EXT + 1];
+static uint64_t bench_profile[EXT + 1][EXT + 1];  // of the benchmarks only
+static int trigger_op = -1, trigger_arg;
+
+static void profile_apply(int op, int arg) {
+  profile[op][arg]++;
+  if (op != EXT && arg != EXT) {
+    trigger_op = op;
+    trigger_arg = arg;
+  }
+}
+
+// Probes are never called: MAX_ARITY arguments exceed any rule.
+static UnlCell* probe_overflow(UnlCell* args[]) {
+  errexit("a probe has been applied to %d arguments\n", UNLAMBDA_EXT_MAX_ARITY);
+  return NULL;
+}
+
+// Growable string
+typedef struct {
+  char* s;
+  size_t len, cap;
+} Str;
+
+static void str_add(Str* str, const char* fmt, ...) {
+  va_list arg;
+  for (;;) {
+    va_start(arg, fmt);
+    int n = vsnprintf(str->s + str->len, str->cap - str->len, fmt, arg);
+    va_end(arg);
+    if (str->len + n < str->cap) {
+      str->len += n;
+      return;
+    }
+    str->cap = str->cap ? (str->len + n) * 2 : 256;
+    if (!(str->s = realloc(str->s, str->cap)))
+      errexit("Out of memory\n");
+  }
+}
+
+// Prints a value in SKI form, so that the combinators of run() compare
+// equal to the applications they stand for.
+static void show(Str* str, Cell* c) {
+  switch (c->t) {
+  case I: str_add(str, "i"); break;
+  case K: str_add(str, "k"); break;
+  case S: str_add(str, "s"); break;
+  case V: str_add(str, "v"); break;
+  case D: str_add(str, "d"); break;
+  case C: str_add(str, "c"); break;
+  case E: str_add(str, "e"); break;
+  case AT: str_add(str, "@"); break;
+  case PIPE: str_add(str, "|"); break;
+  case DOT: str_add(str, c->ch == '\n' ? "r" : ".%c", c->ch); break;
+  case QUES: str_add(str, "?%c", c->ch); break;
+  case K1: str_add(str, "`k"); show(str, c->l); break;
+  case S1: str_add(str, "`s"); show(str, c->l); break;
+  case B1: str_add(str, "`s`k"); show(str, c->l); break;
+  case D1: str_add(str, "`d"); show(str, c->l); break;
+  case S2: str_add(str, "``s"); show(str, c->l); show(str, c->r); break;
+  case B2: str_add(str, "``s`k"); show(str, c->l); show(str, c->r); break;
+  case C2: str_add(str, "``s"); show(str, c->l); str_add(str, "`k"); show(str, c->r); break;
+  case T1: str_add(str, "``si`k"); show(str, c->l); break;
+  case TN:
+    for (uint32_t i = 0; i < c->id; i++)
+      str_add(str, "``si`k");
+    show(str, c->l);
+    break;
+  case V2:
+    str_add(str, "``s``si`k");
+    show(str, c->l);
+    str_add(str, "`k");
+    show(str, c->r);
+    break;
+  case EXT:
+    if (c->id == 0) {
+      str_add(str, "$%c", c->ch);
+    } else {
+      str_add(str, "`");
+      show(str, c->l);
+      show(str, c->r);
+    }
+    break;
+  case AP: case AP_DIRECT: case AP_LEFT_VALUE: case AP_RIGHT_VALUE:
+    str_add(str, "`");
+    show(str, c->l);
+    show(str, c->r);
+    break;
+  default:
+    // Continuations and closures cannot be compared.
+    str_add(str, "<%s %p>", c->t <= EXT ? type_names[c->t] : "?", (void*)c);
+    break;
+  }
+}
+
+static Cell* young_alloc(CellType t, Cell* l, Cell* r) {
+  Cell* c = cell_info[t].size == LARGE_CELL_SIZE
+    ? new_cell(t, l, r) : new_cell1(t, l);
+  c->id = 0;
+  return c;
+}
+
+static bool clear_id(Cell* c) {
+  c->id = 0;
+  return true;
+}
+
+// The result of evaluating an expression.
+typedef struct {
+  Str output, value;
+  bool neutral;  // the value is a probe applied to arguments
+  uint64_t applications, bytes;
+} Observation;
+
+static void observe(const char* text, Observation* o) {
+  // The expression is built in the young generation, so that it is
+  // collected with the garbage of its run. Nothing else is live.
+  size_t len = strlen(text);
+  if (YOUNG_FULL(len + NUM_CELL_TYPES))
+    gc_run(NULL, 0);
+  Input in;
+  input_from_memory(&in, (const uint8_t*)text, len);
+  Cell* pre[NUM_CELL_TYPES];
+  parse_builtins(pre, young_alloc);
+  uint32_t id = 0;
+  Cell* e = parse_tree(&in, young_alloc, pre, &id, NULL);
+  for_each_node(e, clear_id);  // not program nodes
+
+  Input no_input;
+  input_from_memory(&no_input, NULL, 0);
+  Output out;
+  output_to_memory(&out, NULL, 0);
+  uint64_t apps = applications, gcs = minor_gc_count;
+  char* start = free_ptr;
+  RunState st;
+  run_init(&st, e, FEATURE_ALL, &no_input, &out);
+  run(&st);
+  o->applications = applications - apps;
+  o->bytes = minor_gc_count == gcs ? free_ptr - start : 0;
+  o->output.len = o->value.len = 0;
+  str_add(&o->output, "%.*s", (int)(out.ptr - out.buf), out.buf);
+  show(&o->value, st.val);
+  o->neutral = st.val->t == EXT;
+  output_close(&out);
+}
+
+static bool is_variable(int ch) {
+  return islower(ch) && !strchr("ikvsdcer", ch);
+}
+
+// Copies side with the variables replaced by their instantiations.
+static void instantiate(Str* str, const char* side, const char* vars,
+                        const char* const values[]) {
+  for (const char* p = side; *p; p++) {
+    if (*p == '.' || *p == '?' || *p == '$') {
+      str_add(str, "%c%c", p[0], p[1]);
+      p++;
+    } else if (is_variable(*p)) {
+      str_add(str, "%s", values[strchr(vars, *p) - vars]);
+    } else {
+      str_add(str, "%c", *p);
+    }
+  }
+}
+
+// Evaluates the instantiated side applied to arg (if not NULL) and to n
+// extra probes $1..$n.
+static void observe_applied(Str* text, const char* side, const char* vars,
+                            const char* const values[], const char* arg,
+                            int n, Observation* o) {
+  text->len = 0;
+  for (int i = 0; i < n + (arg != NULL); i++)
+    str_add(text, "`");
+  instantiate(text, side, vars, values);
+  if (arg)
+    str_add(text, "%s", arg);
+  for (int i = 1; i <= n; i++)
+    str_add(text, "$%d", i);
+  observe(text->s, o);
+}
+
+// Returns true if s is a single expression.
+static bool well_formed(const char* s) {
+  int needed = 1;  // expressions still to be read
+  for (; *s; s++) {
+    if (needed == 0)
+      return false;
+    if (*s == '`') {
+      needed++;
+      continue;
+    }
+    if (*s == '.' || *s == '?' || *s == '$') {
+      if (!*++s)
+        return false;
+    }
+    needed--;
+  }
+  return needed == 0;
+}
+
+typedef struct {
+  char name[32];
+  char *lhs, *rhs;
+  char vars[MAX_VARS + 1];
+} Rule;
+
+static bool parse_rule(char* line, Rule* rule) {
+  char* p = line + strspn(line, " \t");
+  if (!*p || *p == '#' || *p == '\n')
+    return false;
+  size_t n = strcspn(p, " \t");
+  if (n >= sizeof(rule->name))
+    n = sizeof(rule->name) - 1;
+  memcpy(rule->name, p, n);
+  rule->name[n] = '\0';
+  char* eq = strchr(p, '=');
+  if (!eq)
+    errexit("%s: no '=' in rule\n", rule->name);
+  *eq = '\0';
+  rule->lhs = p + n;
+  rule->rhs = eq + 1;
+  rule->rhs[strcspn(rule->rhs, "#\n")] = '\0';
+
+  // Removes the spaces, and collects the variables of the lhs.
+  rule->vars[0] = '\0';
+  for (int side = 0; side < 2; side++) {
+    char* s = side ? rule->rhs : rule->lhs;
+    char* d = s;
+    for (; *s; s++) {
+      if (isspace(*s))
+        continue;
+      if ((*s == '.' || *s == '?' || *s == '$') && s[1])
+        *d++ = *s++;
+      else if (is_variable(*s) && !strchr(rule->vars, *s)) {
+        if (side)
+          errexit("%s: variable %c is not in the lhs\n", rule->name, *s);
+        size_t nv = strlen(rule->vars);
+        if (nv == MAX_VARS)
+          errexit("%s: more than %d variables\n", rule->name, MAX_VARS);
+        rule->vars[nv] = *s;
+        rule->vars[nv + 1] = '\0';
+      }
+      *d++ = *s;
+    }
+    *d = '\0';
+  }
+  if (!well_formed(rule->lhs) || !well_formed(rule->rhs))
+    errexit("%s: a side is not a single expression\n", rule->name);
+  return true;
+}
+
+// Returns false and prints a counterexample if the sides differ for some
+// instantiation.
+static bool check_rule(Rule* rule, long* cases) {
+  static const char* const choices[] = {NULL, "i", "k", "s", "v", "d", NULL};
+  enum { NUM_CHOICES = sizeof(choices) / sizeof(choices[0]) };
+  int nvars = strlen(rule->vars);
+  int choice[MAX_VARS] = {0};
+  char probes[MAX_VARS][3], effects[MAX_VARS][3];
+  const char* values[MAX_VARS];
+  for (int i = 0; i < nvars; i++) {
+    snprintf(probes[i], 3, "$%c", rule->vars[i]);
+    snprintf(effects[i], 3, ".%c", toupper(rule->vars[i]));
+  }
+  Str text = {0};
+  Observation l = {{0}}, r = {{0}};
+  bool ok = true;
+  *cases = 0;
+  for (;;) {
+    for (int i = 0; i < nvars; i++) {
+      values[i] = choice[i] == 0 ? probes[i]
+        : choice[i] == NUM_CHOICES - 1 ? effects[i] : choices[choice[i]];
+    }
+    ++*cases;
+    for (int pass = 0; ok && pass < 2; pass++) {
+      const char* arg = pass ? EFFECT_ARG : NULL;
+      int n = 0;
+      for (;; n++) {
+        observe_applied(&text, rule->lhs, rule->vars, values, arg, n, &l);
+        observe_applied(&text, rule->rhs, rule->vars, values, arg, n, &r);
+        if ((l.neutral && r.neutral) || n == MAX_EXTRA ||
+            strcmp(l.output.s, r.output.s))
+          break;
+      }
+      if (strcmp(l.output.s, r.output.s) || strcmp(l.value.s, r.value.s)) {
+        printf("%-8s differs for", rule->name);
+        for (int i = 0; i < nvars; i++)
+          printf(" %c=%s", rule->vars[i], values[i]);
+        if (arg || n)
+          printf(" applied to %s", arg ? arg : "");
+        if (n)
+          printf(n == 1 ? "%s$1" : "%s$1..$%d", arg ? " " : "", n);
+        printf(":\n  lhs prints \"%s\" and gives %s\n  rhs prints \"%s\" and gives %s\n",
+               l.output.s, l.value.s, r.output.s, r.value.s);
+        ok = false;
+      }
+    }
+    if (!ok)
+      break;
+    int i = 0;
+    while (i < nvars && ++choice[i] == NUM_CHOICES)
+      choice[i++] = 0;
+    if (i == nvars)
+      break;
+  }
+  free(text.s);
+  free(l.output.s);
+  free(l.value.s);
+  free(r.output.s);
+  free(r.value.s);
+  return ok;
+}
+
+// Prints the cost of both sides with probes for all the variables, and the
+// savings estimated from the benchmark profile.
+static void print_cost(Rule* rule, bool benchmarks) {
+  const char* values[MAX_VARS];
+  char probes[MAX_VARS][3];
+  for (int i = 0; rule->vars[i]; i++) {
+    snprintf(probes[i], 3, "$%c", rule->vars[i]);
+    values[i] = probes[i];
+  }
+  Str text = {0};
+  Observation l = {{0}}, r = {{0}};
+  trigger_op = -1;
+  observe_applied(&text, rule->lhs, rule->vars, values, NULL, 0, &l);
+  int op = trigger_op, arg = trigger_arg;
+  observe_applied(&text, rule->rhs, rule->vars, values, NULL, 0, &r);
+  printf("         %" PRIu64 " -> %" PRIu64 " applications, %" PRIu64 " -> %"
+         PRIu64 " bytes", l.applications, r.applications, l.bytes, r.bytes);
+  if (op < 0) {
+    printf(", no trigger\n");
+  } else {
+    printf(", trigger %s %s\n", type_names[op], type_names[arg]);
+    if (benchmarks) {
+      uint64_t uses = bench_profile[op][arg];
+      printf("         benchmarks: %" PRIu64 " uses, saving up to %" PRId64
+             " applications and %" PRId64 " bytes\n", uses,
+             (int64_t)(uses * (l.applications - r.applications)),
+             (int64_t)(uses * (l.bytes - r.bytes)));
+    }
+  }
+  free(text.s);
+  free(l.output.s);
+  free(l.value.s);
+  free(r.output.s);
+  free(r.value.s);
+}
+
+static void run_benchmark(char* spec) {
+  char* input_file = strchr(spec, ':');
+  if (input_file)
+    *input_file++ = '\0';
+  Cell* root = load_program(spec, NULL);
+  int features = program_features(root);
+  size_t len = 0;
+  uint8_t* input = NULL;
+  if (input_file) {
+    int fd = open(input_file, O_RDONLY);
+    if (fd < 0)
+      errexit("cannot open %s\n", input_file);
+    input = read_all(fd, &len);
+    close(fd);
+  }
+  Input in;
+  input_from_memory(&in, input, len);
+  Output out;
+  output_to_memory(&out, NULL, 0);
+  uint64_t apps = applications;
+  RunState st;
+  run_init(&st, root, features, &in, &out);
+  run(&st);
+  output_close(&out);
+  free(input);
+  printf("%s: %" PRIu64 " applications\n", spec, applications - apps);
+}
+
+typedef struct {
+  int op, arg;
+  uint64_t count;
+} Pair;
+
+static int compare_pairs(const void* a, const void* b) {
+  uint64_t x = ((const Pair*)a)->count, y = ((const Pair*)b)->count;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Prints the most frequent operator and argument types: the shapes where
+// a new rule would pay off.
+static void print_profile(int top) {
+  Pair pairs[(EXT + 1) * (EXT + 1)];
+  int n = 0;
+  for (int op = 0; op <= EXT; op++) {
+    for (int arg = 0; arg <= EXT; arg++) {
+      if (profile[op][arg])
+        pairs[n++] = (Pair){op, arg, profile[op][arg]};
+    }
+  }
+  qsort(pairs, n, sizeof(Pair), compare_pairs);
+  printf("most frequent applications (operator argument):\n");
+  for (int i = 0; i < n && i < top; i++) {
+    printf("  %-8s %-8s %12" PRIu64 " (%4.1f%%)\n", type_names[pairs[i].op],
+           type_names[pairs[i].arg], pairs[i].count,
+           100.0 * pairs[i].count / applications);
+  }
+}
+
+static void usage(const char* progname) {
+  fprintf(stderr, "Usage: %s [-b prog.unl[:input]]... [-m top] [rules]\n", progname);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  char** benchmarks = malloc(sizeof(char*) * argc);
+  int nbench = 0, top = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:m:")) != -1) {
+    switch (opt) {
+    case 'b': benchmarks[nbench++] = optarg; break;
+    case 'm': top = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (argc - optind > 1)
+    usage(argv[0]);
+
+  storage_init();
+  tier_init();  // for the rule expressions, whose nodes are all id 0
+  for (int i = 0; i < nbench; i++)
+    run_benchmark(benchmarks[i]);
+  if (top)
+    print_profile(top);
+
+  if (optind == argc)
+    return 0;
+  FILE* fp = fopen(argv[optind], "r");
+  if (!fp)
+    errexit("cannot open %s\n", argv[optind]);
+  // Probes for the variables, and $1..$9 for the extra arguments.
+  for (int ch = 'a'; ch <= 'z'; ch++) {
+    if (is_variable(ch))
+      ext_define(ch, UNLAMBDA_EXT_MAX_ARITY, probe_overflow, NULL);
+  }
+  for (int ch = '1'; ch <= '9'; ch++)
+    ext_define(ch, UNLAMBDA_EXT_MAX_ARITY, probe_overflow, NULL);
+  memcpy(bench_profile, profile, sizeof(profile));
+
+  int failed = 0;
+  char line[1024];
+  Rule rule;
+  while (fgets(line, sizeof(line), fp)) {
+    if (!parse_rule(line, &rule))
+      continue;
+    long cases;
+    if (check_rule(&rule, &cases)) {
+      printf("%-8s holds (%ld cases)\n", rule.name, cases);
+      print_cost(&rule, nbench > 0);
+    } else {
+      failed++;
+    }
+  }
+  fclose(fp);
+  return failed ? 1 : 0;
+}
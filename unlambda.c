@@ -3,14 +3,35 @@
 // Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
 // This code is licensed under the MIT License (see LICENSE file for details).
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "unlambda_ext.h"
 
 #define VERSION "1.0.0"
 
@@ -20,6 +41,7 @@ enum {
   V_STATS,
   V_MAJOR_GC,
   V_MINOR_GC,
+  V_VERIFY,
 } verbosity = V_NONE;
 
 static void errexit(char *fmt, ...) {
@@ -34,123 +56,485 @@ static void errexit(char *fmt, ...) {
 
 typedef enum {
   // Expressions
-  I, DOT, K1, K, S2, B2, C2, V2, S1, B1, T1, S, V, D1, D, CONT, C, E, AT, QUES, PIPE, AP,
+  I, DOT, K1, K, S2, B2, C2, V2, S1, B1, T1, S, V, D1, D, CONT, C, E, AT, QUES, PIPE,
+  CLOSURE, TN, EXT, AP,
+  // Tier-1 forms of program AP nodes (see tier_up)
+  AP_DIRECT, AP_LEFT_VALUE, AP_RIGHT_VALUE,
+  // Lambda terms (see recover_lambdas)
+  TERM, ENV, LAM, LAPP, VAR, CONST,
+  // Parts of the program not parsed yet (see pipeline_parse, lazy_expand)
+  HOLE, LAZY,
   // Continuations
-  EVAL_RIGHT, EVAL_RIGHT_S, APPLY, APPLY_T, EXIT,
+  EVAL_RIGHT, EVAL_RIGHT_S, APPLY, APPLY_T, EXIT, MEMO,
   // GC
-  COPIED,
+  COPIED, MERGED,
 } CellType;
 
 typedef struct _Cell {
-  CellType t;
-  uint8_t ch;  // for DOT and QUES
-  uint8_t age;
+  uint8_t t;  // CellType
+  uint8_t ch;  // for DOT and QUES; for EXT, the name
   bool marked;
+  uint32_t id;  // for program AP nodes, index into the tiering tables;
+                // for TN, the number of T1s; for EXT, the number of
+                // arguments taken
   struct _Cell *l, *r;
 } Cell;
 
-#define YOUNG_SIZE (256*1024)
-#define HEAP_CHUNK_SIZE (256*1024-1)
-#define AGE_MAX 2
+// Unlambda Lisp represents numbers as chains of T1 cells, `T`T..`Tx, which
+// can make up most of the live heap. When a minor GC copies such a chain, it
+// is replaced by a single TN cell (l: x, id: length), and the evaluator
+// peels one T1 off at every application. That allocates the rest of the
+// chain as a new young cell, so walking a chain of n takes n allocations,
+// where the T1 cells took none. The other cells of the chain are left as
+// MERGED cells (l: x, id: their own depth), so that references to the
+// middle of the chain get TN cells of their own. A chain longer than
+// UINT32_MAX is kept as several TN cells.
+
+// Cells of types that only use l are allocated without r, in 16 bytes
+// instead of 24. The nursery holds both sizes, and the old generation keeps
+// a separate set of chunks and a free list for each size.
+#define SMALL_CELL_SIZE offsetof(Cell, r)
+#define LARGE_CELL_SIZE sizeof(Cell)
+
+// Per-type layout, used by the allocators and both collectors.
+typedef struct {
+  uint8_t size;      // SMALL_CELL_SIZE or LARGE_CELL_SIZE
+  uint8_t pointers;  // TRACE_* bits of the fields pointing to cells
+  uint8_t flags;     // CELL_* kind
+} CellInfo;
+
+#define TRACE_L 1
+#define TRACE_R 2
+#define TRACE_LR (TRACE_L | TRACE_R)
+
+#define CELL_VALUE 1
+#define CELL_NODE 2   // program or evaluator AP node
+#define CELL_CONT 4
+#define CELL_STUB 8   // only exists during a minor GC
+
+#define NUM_CELL_TYPES (MERGED + 1)
+
+static const CellInfo cell_info[NUM_CELL_TYPES] = {
+  [I] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [DOT] =            {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [K1] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [K] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [S2] =             {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [B2] =             {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [C2] =             {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [V2] =             {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [S1] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [B1] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [T1] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [S] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [V] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [D1] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [D] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [CONT] =           {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [C] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [E] =              {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [AT] =             {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [QUES] =           {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [PIPE] =           {SMALL_CELL_SIZE, 0, CELL_VALUE},
+  [CLOSURE] =        {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [TN] =             {SMALL_CELL_SIZE, TRACE_L, CELL_VALUE},
+  [EXT] =            {LARGE_CELL_SIZE, TRACE_LR, CELL_VALUE},
+  [AP] =             {LARGE_CELL_SIZE, TRACE_LR, CELL_NODE},
+  [AP_DIRECT] =      {LARGE_CELL_SIZE, TRACE_LR, CELL_NODE},
+  [AP_LEFT_VALUE] =  {LARGE_CELL_SIZE, TRACE_LR, CELL_NODE},
+  [AP_RIGHT_VALUE] = {LARGE_CELL_SIZE, TRACE_LR, CELL_NODE},
+  [TERM] =           {LARGE_CELL_SIZE, TRACE_LR, 0},
+  [ENV] =            {LARGE_CELL_SIZE, TRACE_LR, 0},
+  [LAM] =            {SMALL_CELL_SIZE, TRACE_L, 0},
+  [LAPP] =           {LARGE_CELL_SIZE, TRACE_LR, 0},
+  [VAR] =            {SMALL_CELL_SIZE, 0, 0},
+  [CONST] =          {SMALL_CELL_SIZE, TRACE_L, 0},
+  [HOLE] =           {SMALL_CELL_SIZE, TRACE_L, CELL_NODE},
+  [LAZY] =           {LARGE_CELL_SIZE, 0, CELL_NODE},
+  [EVAL_RIGHT] =     {LARGE_CELL_SIZE, TRACE_LR, CELL_CONT},
+  [EVAL_RIGHT_S] =   {LARGE_CELL_SIZE, TRACE_LR, CELL_CONT},
+  [APPLY] =          {LARGE_CELL_SIZE, TRACE_LR, CELL_CONT},
+  [APPLY_T] =        {LARGE_CELL_SIZE, TRACE_LR, CELL_CONT},
+  [EXIT] =           {LARGE_CELL_SIZE, 0, CELL_CONT},
+  [MEMO] =           {LARGE_CELL_SIZE, TRACE_LR, CELL_CONT},
+  [COPIED] =         {SMALL_CELL_SIZE, 0, CELL_STUB},
+  [MERGED] =         {SMALL_CELL_SIZE, TRACE_L, CELL_STUB},
+};
+
+static inline size_t cell_size(CellType t) {
+  return cell_info[t].size;
+}
+
+// The nursery is an eden, where cells are allocated, and two survivor
+// spaces. A minor GC copies the live cells of the eden into the empty
+// survivor space, and promotes those of the other survivor space to the
+// old generation, so a cell's age is given by the space it is in. Usually
+// only 1-2% of the eden survives, so the survivor spaces are small; cells
+// that do not fit are promoted early.
+//
+// The sizes below are defaults: the GC parameters can be set with --gc, or
+// by the configuration tuned for the program (see GC parameters).
+#define YOUNG_SIZE (512*1024)  // in large cells
+#define HEAP_CHUNK_SIZE (256*1024-1)   // cells in the smallest chunk
+#define HEAP_GROWTH_RATIO 2            // later chunks are 1/2 of the heap
 #define INITIAL_MARK_STACK_SIZE (64*1024)
+#define MARK_STACK_RATIO 64            // one stack slot per 64 old cells
 
-Cell young1[YOUNG_SIZE];
-Cell young2[YOUNG_SIZE];
+static size_t young_size = YOUNG_SIZE;
+static int heap_growth_ratio = HEAP_GROWTH_RATIO;
+#define YOUNG_BYTES (young_size * LARGE_CELL_SIZE)
+#define SURVIVOR_BYTES (YOUNG_BYTES / 16)
+#define EDEN_BYTES (YOUNG_BYTES - 2 * SURVIVOR_BYTES)
+
+// The nursery, allocated by storage_init()
+static char* young;
+static char* young_end;
+static char* survivors;
+#define EDEN young
+#define SURVIVORS survivors
+
+// Mark bits of young cells for major GCs, one per 8 bytes, so that they
+// can be cleared without walking the nursery.
+static uint8_t* young_marks;
 
 typedef struct _HeapChunk {
-  Cell cells[HEAP_CHUNK_SIZE];
   struct _HeapChunk *next;
+  size_t size;
+  size_t cell_size;
+  off_t spill_offset;  // offset in the spill file, or -1 if malloc'ed
+  size_t spill_bytes;
+  int idle;            // consecutive major GCs without live cells
+  Cell cells[];
 } HeapChunk;
 
+int heap_chunk_size = HEAP_CHUNK_SIZE;
 HeapChunk* old_area;
-Cell* free_list;
+Cell* free_list;        // large cells
+Cell* free_list_small;  // small cells
+
+// Chunks holding the program when it is shared by several sessions. Their
+// cells are marked permanently, so major GCs neither trace nor sweep them.
+HeapChunk* program_area;
+
+// Cells of this age or older are promoted by the next minor GC: 0 in the
+// eden, 1 in a survivor space. With 2, cells stay in the survivor spaces
+// until they do not fit.
+static int tenure_age = 1;
 
-Cell *free_ptr, *young_area_end, *next_young_area;
+char *free_ptr;                    // allocation pointer in the eden
+char *survivor, *survivor_end;     // survivor space in use, and its end
+char *to_space, *to_ptr;           // the other one, used during minor GCs
+
+typedef struct {
+  Cell** cells;
+  int n, size;
+} CellList;
+
+static CellList promoted;  // promoted cells not yet scanned
+
+// Old cells that may point to young ones. A cell's children are normally
+// promoted no later than the cell itself, but a cell promoted early because
+// the survivor space is full can point to cells copied there. The next
+// minor GC scans these cells again.
+static CellList remembered;
+
+// Values of d promises memoized by the evaluator (see memo_end), roots for
+// both collectors. There are no more of them than forced program nodes, and
+// usually few, so every minor GC goes through all of them.
+static CellList memo_values;
+
+// Builtin cells shared by the nodes that --lazy builds (see lazy_child()),
+// roots for major GCs.
+static Cell* lazy_builtins[NUM_CELL_TYPES];
+
+// True if fewer than n cells of any size can be allocated in the nursery.
+#define YOUNG_FULL(n) (free_ptr + (n) * LARGE_CELL_SIZE > SURVIVORS)
 
 static double total_gc_time = 0.0;
-static int major_gc_count = 0;
-static int minor_gc_count = 0;
+static uint64_t total_scanned;  // cells scanned by minor GCs
+static uint64_t major_gc_count = 0;
+static uint64_t minor_gc_count = 0;
+static uint64_t young_bytes;     // allocated in the eden before the last minor GC
+static uint64_t promoted_cells;  // promoted by minor GCs
+
+static inline Cell* chunk_cell(HeapChunk* chunk, size_t i) {
+  return (Cell*)((char*)chunk->cells + i * chunk->cell_size);
+}
 
-static void grow() {
-  HeapChunk* chunk = malloc(sizeof(HeapChunk));
-  if (chunk == NULL)
+static inline Cell** free_list_for(size_t size) {
+  return size == SMALL_CELL_SIZE ? &free_list_small : &free_list;
+}
+
+// With --spill, old generation chunks are mapped from a file, so that the
+// kernel can write them back and page them out instead of running out of
+// memory. Chunks that have held no live cells for SPILL_COLD_GCS major GCs
+// are unmapped, and their file ranges reused for new chunks.
+#define SPILL_COLD_GCS 3
+
+typedef struct {
+  off_t offset;
+  size_t bytes;
+} SpillRange;
+
+static int spill_fd = -1;
+static off_t spill_size;
+static SpillRange* spill_holes;
+static int num_spill_holes, spill_holes_size;
+
+static void spill_open(const char* dir) {
+  char* path = malloc(strlen(dir) + sizeof("/unlambda-spill-XXXXXX"));
+  if (!path)
     errexit("Out of memory\n");
+  sprintf(path, "%s/unlambda-spill-XXXXXX", dir);
+  spill_fd = mkstemp(path);
+  if (spill_fd < 0)
+    errexit("cannot create spill file in %s: %s\n", dir, strerror(errno));
+  unlink(path);
+  free(path);
+}
+
+static HeapChunk* spill_map(size_t bytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  bytes = (bytes + page - 1) / page * page;
+
+  // First fit among the ranges of released chunks
+  off_t offset = -1;
+  for (int i = 0; i < num_spill_holes; i++) {
+    if (spill_holes[i].bytes >= bytes) {
+      offset = spill_holes[i].offset;
+      bytes = spill_holes[i].bytes;
+      spill_holes[i] = spill_holes[--num_spill_holes];
+      break;
+    }
+  }
+  if (offset < 0) {
+    offset = spill_size;
+    if (ftruncate(spill_fd, spill_size + bytes) < 0)
+      errexit("cannot extend spill file: %s\n", strerror(errno));
+    spill_size += bytes;
+  }
+  HeapChunk* chunk = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          spill_fd, offset);
+  if (chunk == MAP_FAILED)
+    errexit("cannot map spill file: %s\n", strerror(errno));
+  chunk->spill_offset = offset;
+  chunk->spill_bytes = bytes;
+  return chunk;
+}
+
+static void spill_unmap(HeapChunk* chunk) {
+  if (num_spill_holes == spill_holes_size) {
+    spill_holes_size = spill_holes_size ? spill_holes_size * 2 : 16;
+    spill_holes = realloc(spill_holes, sizeof(SpillRange) * spill_holes_size);
+    if (!spill_holes)
+      errexit("Out of memory\n");
+  }
+  SpillRange hole = {chunk->spill_offset, chunk->spill_bytes};
+  spill_holes[num_spill_holes++] = hole;
+  munmap(chunk, chunk->spill_bytes);
+}
+
+// Allocates a chunk of ncells cells of the given size, not yet part of the
+// old generation.
+static HeapChunk* new_chunk(size_t cell_size, size_t ncells) {
+  size_t bytes = sizeof(HeapChunk) + cell_size * ncells;
+  HeapChunk* chunk;
+  if (spill_fd >= 0) {
+    chunk = spill_map(bytes);
+  } else {
+    chunk = malloc(bytes);
+    if (chunk == NULL)
+      errexit("Out of memory\n");
+    chunk->spill_offset = -1;
+  }
+  chunk->idle = 0;
+  chunk->size = ncells;
+  chunk->cell_size = cell_size;
+  return chunk;
+}
+
+// Adds the chunk to the old generation. Its cells from first_free on are
+// free.
+static void add_chunk(HeapChunk* chunk, size_t first_free) {
   chunk->next = old_area;
   old_area = chunk;
+  if (first_free == chunk->size)
+    return;
+  Cell** list = free_list_for(chunk->cell_size);
+  for (size_t i = first_free; i < chunk->size - 1; i++)
+    chunk_cell(chunk, i)->l = chunk_cell(chunk, i + 1);
+  chunk_cell(chunk, chunk->size - 1)->l = *list;
+  *list = chunk_cell(chunk, first_free);
+}
+
+// Adds a chunk of ncells cells of the given size to the old generation.
+static void grow_by(size_t cell_size, size_t ncells) {
+  add_chunk(new_chunk(cell_size, ncells), 0);
+}
 
-  for (int i = 0; i < HEAP_CHUNK_SIZE - 1; i++)
-    chunk->cells[i].l = &chunk->cells[i + 1];
-  chunk->cells[HEAP_CHUNK_SIZE - 1].l = free_list;
-  free_list = chunk->cells;
+static void grow(size_t cell_size) {
+  grow_by(cell_size, heap_chunk_size);
+}
+
+static void free_chunk(HeapChunk* chunk) {
+  if (chunk->spill_offset < 0)
+    free(chunk);
+  else
+    spill_unmap(chunk);
+}
+
+// Number of cells in the old generation.
+static uint64_t old_cells() {
+  uint64_t n = 0;
+  for (HeapChunk* chunk = old_area; chunk; chunk = chunk->next)
+    n += chunk->size;
+  return n;
+}
+
+static void free_chunks(HeapChunk* chunk) {
+  while (chunk) {
+    HeapChunk* next = chunk->next;
+    free_chunk(chunk);
+    chunk = next;
+  }
+}
+
+static void cell_list_push(CellList* list, Cell* c) {
+  if (list->n == list->size) {
+    list->size = list->size ? list->size * 2 : 1024;
+    list->cells = realloc(list->cells, sizeof(Cell*) * list->size);
+    if (!list->cells)
+      errexit("Out of memory\n");
+  }
+  list->cells[list->n++] = c;
+}
+
+// Drops the cells not marked by a major GC.
+static void cell_list_retain_marked(CellList* list) {
+  int n = 0;
+  for (int i = 0; i < list->n; i++) {
+    if (list->cells[i]->marked)
+      list->cells[n++] = list->cells[i];
+  }
+  list->n = n;
+}
+
+// Drops all young cells.
+static void young_reset() {
+  free_ptr = EDEN;
+  survivor_end = survivor;
+  remembered.n = 0;
 }
 
 static void storage_init() {
-  free_ptr = young1;
-  young_area_end = free_ptr + YOUNG_SIZE;
-  next_young_area = young2;
-  grow();
+  young = malloc(YOUNG_BYTES);
+  young_marks = calloc(YOUNG_BYTES / 64, 1);
+  if (!young || !young_marks)
+    errexit("Out of memory\n");
+  young_end = young + YOUNG_BYTES;
+  survivors = young + EDEN_BYTES;
+  survivor = SURVIVORS;
+  to_space = SURVIVORS + SURVIVOR_BYTES;
+  young_reset();
+  grow(LARGE_CELL_SIZE);
+  grow(SMALL_CELL_SIZE);
 }
 
+// Allocates a large cell.
 static inline Cell* new_cell(CellType t, Cell* l, Cell* r) {
-  Cell* c = free_ptr++;
+  Cell* c = (Cell*)free_ptr;
+  free_ptr += LARGE_CELL_SIZE;
   c->t = t;
-  c->age = 0;
   c->l = l;
   c->r = r;
   return c;
 }
 
+// Allocates a small cell.
 static inline Cell* new_cell1(CellType t, Cell* l) {
-  Cell* c = free_ptr++;
+  Cell* c = (Cell*)free_ptr;
+  free_ptr += SMALL_CELL_SIZE;
   c->t = t;
-  c->age = 0;
   c->l = l;
   return c;
 }
 
 static inline Cell* new_cell0(CellType t) {
-  Cell* c = free_ptr++;
+  Cell* c = (Cell*)free_ptr;
+  free_ptr += SMALL_CELL_SIZE;
   c->t = t;
-  c->age = 0;
   return c;
 }
 
+// AP cells created by the evaluator, as opposed to program AP nodes.
+static inline Cell* new_ap(Cell* l, Cell* r) {
+  Cell* c = new_cell(AP, l, r);
+  c->id = 0;
+  return c;
+}
+
+// Allocates a cell in the old generation, growing it if needed.
+static Cell* allocate_from_old(CellType t, Cell* l, Cell* r) {
+  size_t size = cell_size(t);
+  Cell** list = free_list_for(size);
+  if (!*list)
+    grow(size);
+
+  Cell* c = *list;
+  *list = c->l;
+  c->t = t;
+  c->marked = false;
+  c->id = 0;
+  c->l = l;
+  if (size == LARGE_CELL_SIZE)
+    c->r = r;
+  return c;
+}
+
+static inline bool is_young(Cell* c) {
+  return (char*)c >= EDEN && (char*)c < young_end;
+}
+
+// Marks the cell, and returns true if it was already marked.
+static inline bool set_mark(Cell* c) {
+  if (is_young(c)) {
+    size_t i = ((char*)c - (char*)young) / 8;
+    uint8_t bit = 1 << (i % 8);
+    bool marked = young_marks[i / 8] & bit;
+    young_marks[i / 8] |= bit;
+    return marked;
+  }
+  bool marked = c->marked;
+  c->marked = true;
+  return marked;
+}
+
 static void mark(Cell* roots[], int nroot) {
-  int stack_size = INITIAL_MARK_STACK_SIZE;
+  // Sized by the heap, so that large heaps do not go through many doublings
+  size_t stack_size = old_cells() / MARK_STACK_RATIO;
+  if (stack_size < INITIAL_MARK_STACK_SIZE)
+    stack_size = INITIAL_MARK_STACK_SIZE;
+  if (stack_size < (size_t)nroot)
+    stack_size = nroot;
   Cell** stack = malloc(sizeof(Cell*) * stack_size);
   if (!stack)
     errexit("Out of memory\n");
-  int i;
-  for (i = 0; i < nroot; i++)
+  size_t i;
+  for (i = 0; i < (size_t)nroot; i++)
     stack[i] = roots[i];
 
   while (i) {
     Cell* c = stack[--i];
   top:
-    if (!c || c->marked)
+    if (!c)
       continue;
     if (c->t == COPIED)
       c = c->l;
-    c->marked = true;
+    if (set_mark(c))
+      continue;
 
-    switch (c->t) {
-    case K1:
-    case S1:
-    case B1:
-    case D1:
-    case T1:
-    case CONT:
-      c = c->l;
-      goto top;
-    case AP:
-    case S2:
-    case B2:
-    case C2:
-    case V2:
-    case EVAL_RIGHT:
-    case EVAL_RIGHT_S:
-    case APPLY:
-    case APPLY_T:
+    uint8_t pointers = cell_info[c->t].pointers;
+    if (pointers & TRACE_R) {
       if (i >= stack_size) {
         stack_size *= 2;
         stack = realloc(stack, sizeof(Cell*) * stack_size);
@@ -158,10 +542,10 @@ static void mark(Cell* roots[], int nroot) {
           errexit("Out of memory\n");
       }
       stack[i++] = c->r;
+    }
+    if (pointers & TRACE_L) {
       c = c->l;
       goto top;
-    default:
-      break;
     }
   }
   free(stack);
@@ -169,37 +553,77 @@ static void mark(Cell* roots[], int nroot) {
 
 static void major_gc(Cell* roots[], int nroot) {
   mark(roots, nroot);
+  mark(memo_values.cells, memo_values.n);
+  mark(lazy_builtins, NUM_CELL_TYPES);
+  cell_list_retain_marked(&promoted);
+  cell_list_retain_marked(&remembered);
 
   // Sweep
-  int freed = 0, total = 0;
-  for (HeapChunk* chunk = old_area; chunk; chunk = chunk->next) {
-    for (int i = 0; i < HEAP_CHUNK_SIZE; i++) {
-      if (chunk->cells[i].marked)
-        chunk->cells[i].marked = false;
+  free_list = free_list_small = NULL;
+  uint64_t freed[2] = {0, 0}, total[2] = {0, 0};  // large, small
+  uint64_t before[2] = {0, 0};
+  for (HeapChunk* chunk = old_area; chunk; chunk = chunk->next)
+    before[chunk->cell_size == SMALL_CELL_SIZE] += chunk->size;
+  for (HeapChunk** p = &old_area; *p;) {
+    HeapChunk* chunk = *p;
+    int small = chunk->cell_size == SMALL_CELL_SIZE;
+    Cell** list = free_list_for(chunk->cell_size);
+    Cell* list_before = *list;
+    size_t nfreed = 0;
+    for (size_t i = 0; i < chunk->size; i++) {
+      Cell* c = chunk_cell(chunk, i);
+      if (c->marked)
+        c->marked = false;
       else {
-        chunk->cells[i].l = free_list;
-        free_list = &chunk->cells[i];
-        freed++;
+        c->l = *list;
+        *list = c;
+        nfreed++;
       }
     }
-    total += HEAP_CHUNK_SIZE;
+    chunk->idle = nfreed == chunk->size ? chunk->idle + 1 : 0;
+    if (chunk->spill_offset >= 0 && chunk->idle >= SPILL_COLD_GCS &&
+        freed[small] > before[small] / 2) {
+      // Cold chunk, and the newer ones have enough free cells. Its cells
+      // are at the head of the free list.
+      if (verbosity >= V_MAJOR_GC)
+        fprintf(stderr, "spill: released a chunk of %zu cells\n", chunk->size);
+      *list = list_before;
+      *p = chunk->next;
+      spill_unmap(chunk);
+      continue;
+    }
+    freed[small] += nfreed;
+    total[small] += chunk->size;
+    p = &chunk->next;
   }
   if (verbosity >= V_MAJOR_GC)
-    fprintf(stderr, "%d / %d cells freed\n", freed, total);
+    fprintf(stderr, "%" PRIu64 " / %" PRIu64 " cells freed\n",
+            freed[0] + freed[1], total[0] + total[1]);
 
-  for (int i = 0; i < YOUNG_SIZE; i++)
-    young1[i].marked = false;
-  for (int i = 0; i < YOUNG_SIZE; i++)
-    young2[i].marked = false;
+  memset(young_marks, 0, YOUNG_BYTES / 64);
 
-  while (freed < total / 5) {
-    grow();
-    freed += HEAP_CHUNK_SIZE;
-    total += HEAP_CHUNK_SIZE;
+  for (int small = 0; small < 2; small++) {
+    size_t size = small ? SMALL_CELL_SIZE : LARGE_CELL_SIZE;
+    while (!*free_list_for(size) || freed[small] < total[small] / 5) {
+      // Chunks grow with the heap, so that a large heap is reached in a
+      // few steps (and major GCs).
+      size_t n = total[small] / heap_growth_ratio;
+      if (n < (size_t)heap_chunk_size)
+        n = heap_chunk_size;
+      grow_by(size, n);
+      freed[small] += n;
+      total[small] += n;
+    }
   }
   major_gc_count++;
 }
 
+static inline void copy_contents(Cell* to, Cell* from, size_t size) {
+  memcpy(to, from, SMALL_CELL_SIZE);
+  if (size == LARGE_CELL_SIZE)
+    to->r = from->r;
+}
+
 static Cell* copy_cell(Cell* c) {
   if (!c)
     return NULL;
@@ -207,424 +631,3167 @@ static Cell* copy_cell(Cell* c) {
   if (c->t == COPIED)
     return c->l;
 
-  if (c->age > AGE_MAX)
+  if (!is_young(c))
     return c;  // Already promoted
 
+  if (c->t == MERGED) {
+    c->t = c->id == 1 ? T1 : TN;
+  } else if (c->t == T1 && c->l->t == T1 && is_young(c->l)) {
+    // Merge the young part of the chain, and a TN cell it ends in.
+    uint32_t n = 1;
+    Cell* x = c->l;
+    while (x->t == T1 && is_young(x)) {
+      Cell* next = x->l;
+      n++;
+      x = next;
+    }
+    if (x->t == TN && x->id <= UINT32_MAX - n) {
+      n += x->id;
+      x = x->l;
+    }
+    uint32_t depth = n;
+    for (Cell* p = c->l; depth-- > 1 && p->t == T1 && is_young(p);) {
+      Cell* next = p->l;
+      p->t = MERGED;
+      p->id = depth;
+      p->l = x;
+      p = next;
+    }
+    c->t = TN;
+    c->id = n;
+    c->l = x;
+  }
+
+  size_t size = cell_size(c->t);
+  int age = (char*)c >= SURVIVORS;
   Cell* r;
-  if (c->age == AGE_MAX) {
+  if (age >= tenure_age || to_ptr + size > to_space + SURVIVOR_BYTES) {
     // Promotion
-    r = free_list;
-    free_list = free_list->l;
-    free_ptr->t = COPIED;
-    free_ptr->l = r;
-    free_ptr++;
+    Cell** list = free_list_for(size);
+    r = *list;
+    *list = r->l;
+    copy_contents(r, c, size);
+    r->marked = false;
+    cell_list_push(&promoted, r);
+    promoted_cells++;
   } else {
-    r = free_ptr++;
+    r = (Cell*)to_ptr;
+    to_ptr += size;
+    copy_contents(r, c, size);
   }
-  *r = *c;
-  r->age++;
   c->t = COPIED;
   c->l = r;
   return r;
 }
 
+static void verify_cell(Cell* c, const char* where) {
+  if (c->t >= NUM_CELL_TYPES || (cell_info[c->t].flags & CELL_STUB))
+    errexit("[BUG] verify: %s cell %p has type %d\n", where, (void*)c, c->t);
+}
+
+static bool is_remembered(Cell* c) {
+  for (int i = 0; i < remembered.n; i++) {
+    if (remembered.cells[i] == c)
+      return true;
+  }
+  return false;
+}
+
+static void verify_pointer(Cell* c, Cell* p, const char* where) {
+  if (!p)
+    return;
+  if (is_young(p) && ((char*)p < survivor || (char*)p >= survivor_end))
+    errexit("[BUG] verify: %s cell %p (type %d) points to dead cell %p\n",
+            where, (void*)c, c->t, (void*)p);
+  if (!is_young(c) && is_young(p) && !is_remembered(c))
+    errexit("[BUG] verify: old cell %p (type %d) points to young cell %p\n",
+            (void*)c, c->t, (void*)p);
+}
+
+static void verify_fields(Cell* c, const char* where) {
+  verify_cell(c, where);
+  uint8_t pointers = cell_info[c->t].pointers;
+  if (pointers & TRACE_L)
+    verify_pointer(c, c->l, where);
+  if (pointers & TRACE_R)
+    verify_pointer(c, c->r, where);
+}
+
+// Checks the heap after a minor GC: every cell in use has a valid type and
+// points only to the survivor space or to the old generation, and old cells
+// point to young ones only if remembered (no write barrier is needed for
+// that).
+static void verify_heap() {
+  for (Cell* c = free_list; c; c = c->l)
+    c->marked = true;
+  for (Cell* c = free_list_small; c; c = c->l)
+    c->marked = true;
+  for (HeapChunk* chunk = old_area; chunk; chunk = chunk->next) {
+    for (size_t i = 0; i < chunk->size; i++) {
+      Cell* c = chunk_cell(chunk, i);
+      if (c->marked)
+        c->marked = false;
+      else if (cell_size(c->t) != chunk->cell_size)
+        errexit("[BUG] verify: old cell %p of type %d in a chunk of %zu-byte cells\n",
+                (void*)c, c->t, chunk->cell_size);
+      else
+        verify_fields(c, "old");
+    }
+  }
+  for (char* p = survivor; p < survivor_end;) {
+    Cell* c = (Cell*)p;
+    verify_fields(c, "young");
+    p += cell_size(c->t);
+  }
+}
+
 static void gc_run(Cell* roots[], int nroot) {
   clock_t start = clock();
 
-  Cell* scan = free_ptr = next_young_area;
-  next_young_area = young_area_end - YOUNG_SIZE;
-  young_area_end = free_ptr + YOUNG_SIZE;
-
+  char* scan = to_ptr = to_space;
   for (int i = 0; i < nroot; i++) {
-    if (!free_list)
+    if (!free_list || !free_list_small)
       major_gc(roots, nroot);
     if (roots[i])
       roots[i] = copy_cell(roots[i]);
   }
+  for (int i = 0; i < memo_values.n; i++) {
+    if (!free_list || !free_list_small)
+      major_gc(roots, nroot);
+    memo_values.cells[i] = copy_cell(memo_values.cells[i]);
+  }
+  // Remembered cells are scanned like promoted ones.
+  for (int i = 0; i < remembered.n; i++)
+    cell_list_push(&promoted, remembered.cells[i]);
+  remembered.n = 0;
 
-  while (scan < free_ptr) {
-    if (!free_list)
+  long num_alive = 0;
+  for (;;) {
+    if (!free_list || !free_list_small)
       major_gc(roots, nroot);
-    Cell* c = scan;
-    if (c->t == COPIED)
-      c = c->l;
-    switch (c->t) {
-    case COPIED:
-      errexit("[BUG] cannot happen\n");
-      break;
-    case K1:
-    case S1:
-    case B1:
-    case D1:
-    case T1:
-    case CONT:
-      c->l = copy_cell(c->l);
+    Cell* c;
+    bool old = false;
+    if (scan < to_ptr) {
+      c = (Cell*)scan;
+      scan += cell_size(c->t);
+    } else if (promoted.n) {
+      c = promoted.cells[--promoted.n];
+      old = true;
+    } else {
       break;
-    case AP:
-    case S2:
-    case B2:
-    case C2:
-    case V2:
-    case EVAL_RIGHT:
-    case EVAL_RIGHT_S:
-    case APPLY:
-    case APPLY_T:
+    }
+    num_alive++;
+    uint8_t pointers = cell_info[c->t].pointers;
+    if (pointers & TRACE_L)
       c->l = copy_cell(c->l);
-      if (!free_list)
+    if (pointers & TRACE_R) {
+      if (!free_list || !free_list_small)
         major_gc(roots, nroot);
       c->r = copy_cell(c->r);
-      break;
-    default:
-      break;
     }
-    scan++;
+    if (old && (((pointers & TRACE_L) && is_young(c->l)) ||
+                ((pointers & TRACE_R) && is_young(c->r))))
+      cell_list_push(&remembered, c);
   }
-
-  if (verbosity >= V_MINOR_GC) {
-    long num_alive = free_ptr - (young_area_end - YOUNG_SIZE);
+  // The to-space becomes the survivor space, and eden starts over.
+  char* from = survivor;
+  survivor = to_space;
+  survivor_end = to_ptr;
+  to_space = from;
+  young_bytes += free_ptr - EDEN;
+  free_ptr = EDEN;
+  if (verbosity >= V_MINOR_GC)
     fprintf(stderr, "Minor GC: %ld\n", num_alive);
-  }
 
   minor_gc_count++;
+  total_scanned += num_alive;
   total_gc_time += (clock() - start) / (double)CLOCKS_PER_SEC;
+  if (verbosity >= V_VERIFY)
+    verify_heap();
 }
 
-// Parser --------------------------------------------------------------
-
-static Cell* allocate_from_old(CellType t, Cell* l, Cell* r) {
-  if (!free_list)
-    grow();
+// Moves every live young cell to the old generation and empties the
+// nursery, so that it can be handed over to another interpreter instance.
+static void gc_tenure_all(Cell* roots[], int nroot) {
+  int age = tenure_age;
+  tenure_age = 0;
+  gc_run(roots, nroot);
+  tenure_age = age;
+  young_reset();
+}
 
-  Cell* c = free_list;
-  free_list = free_list->l;
-  c->t = t;
-  c->age = AGE_MAX + 1;
-  c->marked = false;
-  c->l = l;
-  c->r = r;
-  return c;
+// Detaches the cells allocated so far (the loaded programs) from the old
+// generation into program_area, to be shared by all sessions or stages of
+// a pipeline.
+static void freeze_program(Cell* roots[], int nroot) {
+  mark(roots, nroot);
+  program_area = old_area;
+  old_area = NULL;
+  free_list = free_list_small = NULL;
 }
 
-static Cell* parse(FILE* fp) {
-  Cell *preI = allocate_from_old(I, NULL, NULL);
-  Cell *preK = allocate_from_old(K, NULL, NULL);
-  Cell *preS = allocate_from_old(S, NULL, NULL);
-  Cell *preV = allocate_from_old(V, NULL, NULL);
-  Cell *preD = allocate_from_old(D, NULL, NULL);
-  Cell *preC = allocate_from_old(C, NULL, NULL);
-  Cell *preE = allocate_from_old(E, NULL, NULL);
-  Cell *preAt = allocate_from_old(AT, NULL, NULL);
-  Cell *prePipe = allocate_from_old(PIPE, NULL, NULL);
+// I/O -----------------------------------------------------------------
 
-  Cell* stack = NULL;
-  Cell* e;
-  do {
-    int ch;
-    do {
-      ch = fgetc(fp);
-      if (ch == '#') {
-        while (ch = fgetc(fp), ch != '\n' && ch != EOF)
-          ;
-      }
-    } while (isspace(ch));
-    switch (ch) {
-    case '`':
-      stack = allocate_from_old(AP, NULL, stack);
-      continue;
-    case 'i': case 'I': e = preI; break;
-    case 'k': case 'K': e = preK; break;
-    case 's': case 'S': e = preS; break;
-    case 'v': case 'V': e = preV; break;
-    case 'd': case 'D': e = preD; break;
-    case 'c': case 'C': e = preC; break;
-    case 'e': case 'E': e = preE; break;
-    case 'r': case 'R': e = allocate_from_old(DOT, NULL, NULL); e->ch = '\n'; break;
-    case '@': e = preAt; break;
-    case '|': e = prePipe; break;
-    case '.': case '?':
-      {
-        int ch2 = fgetc(fp);
-        if (ch2 == EOF)
-          errexit("unexpected EOF\n");
-        e = allocate_from_old(ch == '.' ? DOT : QUES, NULL, NULL);
-        e->ch = ch2;
-        break;
-      }
-    case EOF:
-      errexit("unexpected EOF\n");
-      break;
-    default:
-      errexit("unexpected character %c\n", ch);
-      break;
-    }
-    while (stack) {
-      if (!stack->l) {
-        stack->l = e;
-        break;
-      }
-      Cell* next = stack->r;
-      stack->r = e;
-      e = stack;
-      stack = next;
-    }
-  } while (stack);
-  return e;
-}
+// Input and output are buffered in memory, and a backend refills or drains
+// the buffer. The evaluator and the parser only touch the buffer pointers,
+// so reading from a memory span involves no calls at all.
 
-static Cell* load_program(const char* fname) {
-  FILE* fp;
-  if (fname == NULL)
-    fp = stdin;
-  else {
-    fp = fopen(fname, "r");
-    if (fp == NULL)
-      errexit("cannot open %s\n", fname);
-  }
+#define IO_BUFFER_SIZE (64*1024)
 
-  Cell* c = parse(fp);
+// Returned by the input backends when no input is available yet.
+#define INPUT_PENDING (-2)
 
-  if (fname == NULL) {
-    // If both program and input are from stdin, discard the rest of the
-    // current line, for convenience
-    int ch;
-    do {
-      ch = getchar();
-    } while (ch != EOF && ch != '\n');
-  } else {
-    fclose(fp);
+typedef struct _Output {
+  uint8_t *ptr, *end;  // free part of the buffer (end == buf if unbuffered)
+  uint8_t *buf, *limit;
+  // Drains the buffer, or makes room in it if it is full.
+  void (*flush)(struct _Output* out);
+  bool line_buffered;
+  bool owned;  // buf is allocated by us
+  int fd;
+  void (*write)(void* ctx, const uint8_t* data, size_t len);
+  void* ctx;
+} Output;
+
+typedef struct _Input {
+  const uint8_t *ptr, *end;  // unread part of the buffer
+  // Refills the buffer. Returns the number of bytes read, 0 at EOF, or
+  // INPUT_PENDING.
+  long (*fill)(struct _Input* in);
+  uint8_t* buf;
+  int fd;
+  long (*read)(void* ctx, uint8_t* buf, size_t size);
+  void* ctx;
+  Output* tie;  // flushed before blocking for input
+} Input;
+
+static bool output_overflow(Output* out, int ch) {
+  if (out->ptr == out->limit) {
+    out->flush(out);
+    if (out->ptr == out->limit)
+      return false;
   }
-  return c;
+  *out->ptr++ = ch;
+  if (out->line_buffered && ch == '\n')
+    out->flush(out);
+  return true;
 }
 
-// Evaluator -----------------------------------------------------------
+// Returns false if the output cannot take the byte yet (only when a flush
+// leaves the buffer full, see PipeRing).
+static inline bool output_putc(Output* out, int ch) {
+  if (out->ptr == out->end)
+    return output_overflow(out, ch);
+  *out->ptr++ = ch;
+  return true;
+}
 
-#define PUSHCONT(t, v) (next_cont = new_cell(task, next_cont, task_val), task = t, task_val = v)
-#define POPCONT (task = next_cont->t, task_val = next_cont->r, next_cont = next_cont->l)
+static void output_flush(Output* out) {
+  out->flush(out);
+}
 
-void run(Cell* val) {
-  int current_ch = EOF;
-  Cell* next_cont = NULL;
-  Cell* op;
+static void output_close(Output* out) {
+  out->flush(out);
+  if (out->owned)
+    free(out->buf);
+}
 
-  CellType task = EXIT;
-  Cell* task_val = NULL;
+static void output_init(Output* out, uint8_t* buf, size_t size,
+                        void (*flush)(Output*)) {
+  memset(out, 0, sizeof(Output));
+  if (!buf) {
+    buf = malloc(size);
+    if (!buf)
+      errexit("Out of memory\n");
+    out->owned = true;
+  }
+  out->ptr = out->buf = buf;
+  out->limit = buf + size;
+  out->end = out->limit;
+  out->flush = flush;
+}
 
-  goto eval;
+// Memory output. The buffer grows when full; the output is out->buf up to
+// out->ptr.
+static void memory_output_flush(Output* out) {
+  if (out->ptr < out->limit)
+    return;
+  size_t len = out->ptr - out->buf;
+  size_t size = len * 2;
+  uint8_t* buf = out->owned ? realloc(out->buf, size) : malloc(size);
+  if (!buf)
+    errexit("Out of memory\n");
+  if (!out->owned)
+    memcpy(buf, out->buf, len);
+  out->owned = true;
+  out->buf = buf;
+  out->ptr = buf + len;
+  out->end = out->limit = buf + size;
+}
 
-  for (;;) {
-    switch (task) {
-    case EVAL_RIGHT:
-      // Evaluate `<val><task_val>.
-      if (val->t == D) {
-        op = val;
-        val = task_val;
-        POPCONT;
-        goto apply;
-      } else {
-        Cell* rand = task_val;
-        task = APPLY;
-        task_val = val;
-        val = rand;
-        goto eval;
-      }
-    case EVAL_RIGHT_S:
-      // Evaluate `<val><task_val>, task_val is of the form `<v1><v2>
-      // where v1 and v2 are already evaluated.
-      if (val->t == D) {
-        op = val;
-        val = task_val;
-        POPCONT;
-      } else {
-        Cell* rand = task_val;
-        task = APPLY;
-        task_val = val;
-        op = rand->l;
-        val = rand->r;
-      }
-      goto apply;
-    case APPLY:
-      // Apply `<task_val><val>.
-      op = task_val;
-      POPCONT;
-      goto apply;
-    case APPLY_T:
-      // Apply `<val><task_val>.
-      op = val;
-      val = task_val;
-      POPCONT;
-      goto apply;
-    case EXIT:
-      return;
-    default:
-      errexit("[BUG] run: invalid task type %d\n", task);
-    }
-    continue;
-  eval:
-    while (val->t == AP) {
-      if (free_ptr >= young_area_end) {
-        Cell* roots[3] = {val, task_val, next_cont};
-        gc_run(roots, 3);
-        val = roots[0];
-        task_val = roots[1];
-        next_cont = roots[2];
-      }
-      PUSHCONT(EVAL_RIGHT, val->r);
-      val = val->l;
-    }
-    continue;
-  apply:
-    if (free_ptr + 1 >= young_area_end) {
-      Cell* roots[4] = {val, task_val, next_cont, op};
-      gc_run(roots, 4);
-      val = roots[0];
-      task_val = roots[1];
-      next_cont = roots[2];
-      op = roots[3];
-    }
-    switch (op->t) {
-    case I:
-      break;
-    case DOT:
-      putchar(op->ch);
-      break;
-    case K1:
-      val = op->l;
-      break;
-    case K:
-      val = new_cell1(K1, val);
-      break;
-    case S2:
-      {
-        Cell* e2 = new_cell(AP, op->r, val);
-        PUSHCONT(EVAL_RIGHT_S, e2);
-        op = op->l;
-        goto apply;
-      }
-    case B2:
-      if (op->l->t == D) {
-        Cell* e2 = new_cell(AP, op->r, val);
-        val = new_cell1(D1, e2);
-        break;
-      } else {
-        PUSHCONT(APPLY, op->l);
-        op = op->r;
-        goto apply;
-      }
-    case C2:
-      PUSHCONT(APPLY_T, op->r);
-      op = op->l;
-      goto apply;
-    case V2:
-      {
-        Cell* v = op->l;
-        PUSHCONT(APPLY_T, op->r);
-        op = val;
-        val = v;
-        goto apply;
-      }
-    case S1:
-      val = (val->t == K1)
-        ? (op->l->t == I ? new_cell1(T1, val->l)
-           : op->l->t == T1 ? new_cell(V2, op->l->l, val->l)
-           : new_cell(C2, op->l, val->l))
-        : new_cell(S2, op->l, val);
-      break;
-    case B1:
-      val = new_cell(B2, op->l, val);
-      break;
-    case T1:
-      {
-        Cell* v = op->l;
-        op = val;
-        val = v;
-        goto apply;
+// Writes into the given span, or into an allocated buffer if buf is NULL.
+// Output beyond the span is moved to an allocated buffer.
+void output_to_memory(Output* out, uint8_t* buf, size_t size) {
+  output_init(out, buf, size ? size : IO_BUFFER_SIZE, memory_output_flush);
+}
+
+static void write_all(int fd, const uint8_t* p, size_t len) {
+  const uint8_t* end = p + len;
+  while (p < end) {
+    ssize_t n = write(fd, p, end - p);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+        continue;
       }
-    case S:
-      val = (val->t == K1)
-        ? new_cell1(B1, val->l)
-        : new_cell1(S1, val);
-      break;
-    case V:
-      val = op;
-      break;
-    case D1:
-      PUSHCONT(APPLY_T, val);
-      val = op->l;
-      goto eval;
-    case D:
-      val = new_cell1(D1, val);
-      break;
-    case CONT:
-      next_cont = op->l;
-      POPCONT;
-      break;
-    case C:
-      PUSHCONT(APPLY, val);
-      val = new_cell1(CONT, next_cont);
-      break;
-    case E:
-      task = EXIT;
-      break;
-    case AT:
-      current_ch = getchar();
-      PUSHCONT(APPLY, val);
-      val = new_cell0(current_ch == EOF ? V : I);
-      break;
-    case QUES:
-      PUSHCONT(APPLY, val);
-      val = new_cell0(current_ch == op->ch ? I : V);
-      break;
-    case PIPE:
-      PUSHCONT(APPLY, val);
-      val = new_cell0(current_ch == EOF ? V : DOT);
-      val->ch = current_ch;
-      break;
-    default:
-      errexit("[BUG] apply: invalid operator type %d\n", op->t);
+      break;  // The reader has gone; discard the output.
     }
+    p += n;
   }
 }
 
-// Main ----------------------------------------------------------------
-
-void help(const char *progname) {
-  printf("Usage: %s [options] sourcefile\n", progname);
-  printf("  -h       print this help and exit\n");
-  printf("  -v       print version and exit\n");
-  printf("  -v[0-3]  set verbosity level (default: 0)\n");
+static void fd_output_flush(Output* out) {
+  write_all(out->fd, out->buf, out->ptr - out->buf);
+  out->ptr = out->buf;
 }
 
-int main(int argc, char *argv[]) {
-  char *prog_file = NULL;
-  for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-' && argv[i][1] == 'v' && isdigit(argv[i][2])) {
-      verbosity = argv[i][2] - '0';
-    } else if (strcmp(argv[i], "-h") == 0) {
-      help(argv[0]);
-      return 0;
-    } else if (strcmp(argv[i], "-v") == 0) {
-      printf("Unlambda interpreter " VERSION " by irori\n");
-      return 0;
-    } else if (argv[i][0] == '-') {
-      fprintf(stderr, "bad option %s  (Try -h for more information).\n", argv[i]);
-      return 1;
-    } else {
-      prog_file = argv[i];
-    }
+void output_to_fd(Output* out, int fd) {
+  output_init(out, NULL, IO_BUFFER_SIZE, fd_output_flush);
+  out->fd = fd;
+  if (isatty(fd)) {
+    out->line_buffered = true;
+    out->end = out->buf;
   }
+}
 
-  storage_init();
-  Cell* root = load_program(prog_file);
+static void callback_output_flush(Output* out) {
+  if (out->ptr > out->buf)
+    out->write(out->ctx, out->buf, out->ptr - out->buf);
+  out->ptr = out->buf;
+}
 
-  clock_t start = clock();
-  run(root);
+void output_to_callback(Output* out,
+                        void (*write)(void*, const uint8_t*, size_t),
+                        void* ctx) {
+  output_init(out, NULL, IO_BUFFER_SIZE, callback_output_flush);
+  out->write = write;
+  out->ctx = ctx;
+}
 
-  if (verbosity >= V_STATS) {
-    double evaltime = (clock() - start) / (double)CLOCKS_PER_SEC;
-    fprintf(stderr, "  total eval time --- %5.2f sec.\n", evaltime - total_gc_time);
-    fprintf(stderr, "  total gc time   --- %5.2f sec.\n", total_gc_time);
-    fprintf(stderr, "  major gc count  --- %5d\n", major_gc_count);
-    fprintf(stderr, "  minor gc count  --- %5d\n", minor_gc_count);
+static int input_refill(Input* in) {
+  long n = in->fill(in);
+  if (n == INPUT_PENDING)
+    return INPUT_PENDING;
+  if (n <= 0)
+    return EOF;
+  return *in->ptr++;
+}
+
+// Returns the next byte, EOF, or INPUT_PENDING.
+static inline int input_getc(Input* in) {
+  return in->ptr < in->end ? *in->ptr++ : input_refill(in);
+}
+
+static void input_close(Input* in) {
+  free(in->buf);
+}
+
+static long memory_input_fill(Input* in) {
+  return 0;
+}
+
+// Reads from the given span without copying it.
+void input_from_memory(Input* in, const uint8_t* data, size_t len) {
+  memset(in, 0, sizeof(Input));
+  in->ptr = data;
+  in->end = data + len;
+  in->fill = memory_input_fill;
+}
+
+static void input_alloc(Input* in, long (*fill)(Input*)) {
+  memset(in, 0, sizeof(Input));
+  in->buf = malloc(IO_BUFFER_SIZE);
+  if (!in->buf)
+    errexit("Out of memory\n");
+  in->ptr = in->end = in->buf;
+  in->fill = fill;
+}
+
+static long fd_input_fill(Input* in) {
+  if (in->tie)
+    output_flush(in->tie);
+  ssize_t n;
+  do {
+    n = read(in->fd, in->buf, IO_BUFFER_SIZE);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? INPUT_PENDING : 0;
+  in->ptr = in->buf;
+  in->end = in->buf + n;
+  return n;
+}
+
+void input_from_fd(Input* in, int fd) {
+  input_alloc(in, fd_input_fill);
+  in->fd = fd;
+}
+
+static long callback_input_fill(Input* in) {
+  long n = in->read(in->ctx, in->buf, IO_BUFFER_SIZE);
+  if (n > 0) {
+    in->ptr = in->buf;
+    in->end = in->buf + n;
+  }
+  return n;
+}
+
+// The callback returns the number of bytes stored, 0 at EOF, or
+// INPUT_PENDING to make the evaluator suspend.
+void input_from_callback(Input* in,
+                         long (*read)(void*, uint8_t*, size_t),
+                         void* ctx) {
+  input_alloc(in, callback_input_fill);
+  in->read = read;
+  in->ctx = ctx;
+}
+
+// Reads everything from fd into an allocated buffer.
+static uint8_t* read_all(int fd, size_t* len) {
+  size_t size = IO_BUFFER_SIZE;
+  uint8_t* buf = malloc(size);
+  *len = 0;
+  for (;;) {
+    if (!buf)
+      errexit("Out of memory\n");
+    ssize_t n = read(fd, buf + *len, size - *len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    *len += n;
+    if (*len == size)
+      buf = realloc(buf, size *= 2);
+  }
+  return buf;
+}
+
+// Tiering -------------------------------------------------------------
+
+// Program AP nodes start in tier 0, the generic AP case of the evaluator,
+// which counts evaluations per node. When a node has been evaluated
+// tier_threshold times, it and its subtree are promoted to tier 1: every AP
+// node whose operator or operand is a value is rewritten in place into a
+// form that resolves them ahead of time.
+//
+//   AP_DIRECT       both are values (or the operator is d): apply at once
+//   AP_LEFT_VALUE   the operator is a value other than d: evaluate only the
+//                   operand
+//   AP_RIGHT_VALUE  the operand is a value: evaluate only the operator
+//
+// Nothing else rewrites the AP nodes of the program, so the tier-1 forms
+// stay valid and nodes are never taken back to tier 0. A walk stops at the
+// nodes walked before, whose subtrees have been promoted already, so that
+// every node is walked once however many of its ancestors get hot.
+//
+// -v1 counts node evaluations in each tier, not the time spent in them.
+
+#define DEFAULT_TIER_THRESHOLD 16
+
+static uint32_t tier_threshold = DEFAULT_TIER_THRESHOLD;
+static uint32_t num_nodes;     // number of program AP nodes
+static uint32_t* node_counts;  // tier-0 evaluations, indexed by Cell.id
+static bool* node_walked;      // indexed by Cell.id
+static long tier_up_count, tier1_nodes, tier_walked_nodes;
+static uint64_t tier1_evals;
+
+static void tier_init() {
+  free(node_counts);
+  free(node_walked);
+  node_counts = calloc(num_nodes + 1, sizeof(uint32_t));
+  node_walked = calloc(num_nodes + 1, sizeof(bool));
+  if (!node_counts || !node_walked)
+    errexit("Out of memory\n");
+}
+
+static inline bool is_value(Cell* c) {
+  return c->t < AP;
+}
+
+// Returns the id of an application node, 0 for other cells.
+static inline uint32_t node_id(Cell* c) {
+  return c->t >= AP && c->t <= AP_RIGHT_VALUE ? c->id : 0;
+}
+
+// Calls fn for every AP node in the subtree, in any order, but not for the
+// nodes below one for which fn returns false.
+static void for_each_node(Cell* root, bool (*fn)(Cell*)) {
+  int stack_size = INITIAL_MARK_STACK_SIZE, sp = 0;
+  Cell** stack = malloc(sizeof(Cell*) * stack_size);
+  if (!stack)
+    errexit("Out of memory\n");
+  stack[sp++] = root;
+  while (sp) {
+    Cell* c = stack[--sp];
+    if (is_value(c) || c->t == LAZY)
+      continue;
+    if (sp + 2 > stack_size) {
+      stack_size *= 2;
+      stack = realloc(stack, sizeof(Cell*) * stack_size);
+      if (!stack)
+        errexit("Out of memory\n");
+    }
+    if (!fn(c))
+      continue;
+    stack[sp++] = c->r;
+    stack[sp++] = c->l;
+  }
+  free(stack);
+}
+
+static bool tier_up_node(Cell* c) {
+  if (c->id) {
+    if (node_walked[c->id])
+      return false;
+    node_walked[c->id] = true;
+  }
+  tier_walked_nodes++;
+  if (c->t != AP)
+    return true;
+  if (is_value(c->l) && (is_value(c->r) || c->l->t == D))
+    c->t = AP_DIRECT;
+  else if (is_value(c->l))
+    c->t = AP_LEFT_VALUE;
+  else if (is_value(c->r))
+    c->t = AP_RIGHT_VALUE;
+  else
+    return true;
+  tier1_nodes++;
+  return true;
+}
+
+static void tier_up(Cell* node) {
+  if (!node->id || node_walked[node->id])
+    return;  // Created by the evaluator, or promoted with an ancestor
+  for_each_node(node, tier_up_node);
+  tier_up_count++;
+}
+
+static void print_tier_stats() {
+  uint64_t tier0_evals = 0;
+  for (uint32_t i = 0; i <= num_nodes; i++)
+    tier0_evals += node_counts[i];
+  double total = tier0_evals + tier1_evals;
+  fprintf(stderr, "  tier-ups        --- %5ld (%ld nodes, %ld walked)\n",
+          tier_up_count, tier1_nodes, tier_walked_nodes);
+  fprintf(stderr, "  node evals      --- %.0f (tier 0: %4.1f%%, tier 1: %4.1f%%)\n",
+          total, total ? tier0_evals * 100 / total : 0.0,
+          total ? tier1_evals * 100 / total : 0.0);
+}
+
+// Extensions ----------------------------------------------------------
+
+// Combinators implemented in native code, loaded from shared libraries
+// with --ext (see unlambda_ext.h). $x is an EXT cell (ch: x, id: 0); when
+// applied to fewer arguments than the arity, it makes another EXT cell
+// (l: the EXT cell applied, r: the argument, id: one more), so the
+// arguments are found along l when the last one arrives.
+
+typedef struct {
+  int arity;  // 0 if not defined
+  UnlNative fn;
+  char* pattern;
+} ExtCombinator;
+
+static ExtCombinator extensions[256];
+static int ext_libraries;
+static uint64_t ext_calls;
+static long ext_subtrees;  // program subtrees replaced by a combinator
+
+static void ext_define(int name, int arity, UnlNative fn, const char* pattern) {
+  if (name < 0 || name > 255 || isspace(name))
+    errexit("bad extension combinator name %d\n", name);
+  if (extensions[name].arity)
+    errexit("extension combinator $%c defined twice\n", name);
+  if (arity < 1 || arity > UNLAMBDA_EXT_MAX_ARITY)
+    errexit("$%c: bad arity %d\n", name, arity);
+  extensions[name].arity = arity;
+  extensions[name].fn = fn;
+  if (pattern && !(extensions[name].pattern = strdup(pattern)))
+    errexit("Out of memory\n");
+}
+
+// The evaluator only makes room for a few cells before an application.
+// Once the eden is full, the cells of a native call are allocated in the
+// old generation instead of running a GC, and remembered, since they may
+// point to young cells.
+static Cell* ext_alloc(CellType t, Cell* l, Cell* r) {
+  Cell* c;
+  if (YOUNG_FULL(1)) {
+    c = allocate_from_old(t, l, r);
+    cell_list_push(&remembered, c);
+  } else {
+    c = cell_size(t) == LARGE_CELL_SIZE ? new_cell(t, l, r) : new_cell1(t, l);
+    c->id = 0;
+  }
+  return c;
+}
+
+static Cell* ext_builtin(int name) {
+  switch (tolower(name)) {
+  case 'i': return ext_alloc(I, NULL, NULL);
+  case 'k': return ext_alloc(K, NULL, NULL);
+  case 's': return ext_alloc(S, NULL, NULL);
+  case 'v': return ext_alloc(V, NULL, NULL);
+  case 'r':
+    {
+      Cell* c = ext_alloc(DOT, NULL, NULL);
+      c->ch = '\n';
+      return c;
+    }
+  default:
+    errexit("extension: builtin %c is not available\n", name);
+  }
+  return NULL;
+}
+
+static Cell* ext_dot(int ch) {
+  Cell* c = ext_alloc(DOT, NULL, NULL);
+  c->ch = ch;
+  return c;
+}
+
+static Cell* ext_apply(Cell* f, Cell* x) {
+  return ext_alloc(AP, f, x);
+}
+
+static unsigned long ext_number(Cell* c, Cell** x) {
+  unsigned long n = 0;
+  for (;;) {
+    if (c->t == T1)
+      n++;
+    else if (c->t == TN)
+      n += c->id;
+    else
+      break;
+    c = c->l;
+  }
+  *x = c;
+  return n;
+}
+
+static Cell* ext_make_number(unsigned long n, Cell* x) {
+  for (; n > UINT32_MAX; n -= UINT32_MAX) {
+    x = ext_alloc(TN, x, NULL);
+    x->id = UINT32_MAX;
+  }
+  if (n == 1)
+    return ext_alloc(T1, x, NULL);
+  if (n) {
+    x = ext_alloc(TN, x, NULL);
+    x->id = n;
+  }
+  return x;
+}
+
+static const UnlambdaExt ext_api = {
+  ext_define, ext_builtin, ext_dot, ext_apply, ext_number, ext_make_number,
+};
+
+static void ext_load(const char* path) {
+  void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib)
+    errexit("cannot load %s: %s\n", path, dlerror());
+  int (*init)(const UnlambdaExt*);
+  *(void**)&init = dlsym(lib, "unlambda_ext_init");
+  if (!init)
+    errexit("%s: unlambda_ext_init not found\n", path);
+  ext_libraries++;
+  int version = init(&ext_api);
+  if (version != UNLAMBDA_EXT_VERSION)
+    errexit("%s: built for extension interface %d, not %d\n",
+            path, version, UNLAMBDA_EXT_VERSION);
+}
+
+// Applies the EXT cell op, which has taken all but one argument, to arg.
+// Returns the expression to evaluate.
+static Cell* ext_call(Cell* op, Cell* arg) {
+  ExtCombinator* x = &extensions[op->ch];
+  Cell* args[UNLAMBDA_EXT_MAX_ARITY];
+  int n = x->arity - 1;
+  args[n] = arg;
+  for (Cell* p = op; n; p = p->l)
+    args[--n] = p->r;
+  ext_calls++;
+  Cell* r = x->fn(args);
+  if (!r)
+    errexit("$%c returned NULL\n", op->ch);
+  return r;
+}
+
+// Parser --------------------------------------------------------------
+
+static int read_program_char(Input* in) {
+  int ch = input_getc(in);
+  return ch == INPUT_PENDING ? EOF : ch;
+}
+
+typedef Cell* (*CellAllocator)(CellType t, Cell* l, Cell* r);
+
+// Allocates the shared cells of the builtins without arguments.
+static void parse_builtins(Cell* pre[], CellAllocator alloc) {
+  static const CellType types[] = {I, K, S, V, D, C, E, AT, PIPE};
+  for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    pre[types[i]] = alloc(types[i], NULL, NULL);
+}
+
+// Reads the next token. Returns NULL for a backquote, or the cell of a
+// builtin.
+static Cell* parse_token(Input* in, CellAllocator alloc, Cell* pre[]) {
+  int ch;
+  do {
+    ch = read_program_char(in);
+    if (ch == '#') {
+      while (ch = read_program_char(in), ch != '\n' && ch != EOF)
+        ;
+    }
+  } while (isspace(ch));
+  Cell* e;
+  switch (ch) {
+  case '`': return NULL;
+  case 'i': case 'I': return pre[I];
+  case 'k': case 'K': return pre[K];
+  case 's': case 'S': return pre[S];
+  case 'v': case 'V': return pre[V];
+  case 'd': case 'D': return pre[D];
+  case 'c': case 'C': return pre[C];
+  case 'e': case 'E': return pre[E];
+  case 'r': case 'R': e = alloc(DOT, NULL, NULL); e->ch = '\n'; return e;
+  case '@': return pre[AT];
+  case '|': return pre[PIPE];
+  case '.': case '?':
+    {
+      int ch2 = read_program_char(in);
+      if (ch2 == EOF)
+        errexit("unexpected EOF\n");
+      e = alloc(ch == '.' ? DOT : QUES, NULL, NULL);
+      e->ch = ch2;
+      return e;
+    }
+  case '$':
+    {
+      int ch2 = read_program_char(in);
+      if (ch2 == EOF)
+        errexit("unexpected EOF\n");
+      if (!extensions[ch2].arity)
+        errexit("unknown extension combinator $%c\n", ch2);
+      e = alloc(EXT, NULL, NULL);
+      e->ch = ch2;
+      return e;
+    }
+  case EOF:
+    errexit("unexpected EOF\n");
+  default:
+    errexit("unexpected character %c\n", ch);
+  }
+  return NULL;
+}
+
+// Subtrees parsed before the rest of the program (see parse_parallel).
+typedef struct {
+  size_t start, end;  // text of the subtree
+  uint32_t first_id;  // id of its first AP node in the whole program
+  uint32_t nodes;     // number of AP nodes in it
+  Cell* cell;
+} ParsePiece;
+
+typedef struct {
+  const uint8_t* text;  // start of the memory input
+  ParsePiece *next, *end;
+} PieceCursor;
+
+// Parses a tree, numbering its AP nodes from *id + 1 in the order of their
+// backquotes. With pieces, every piece the input reaches is taken as a
+// single token.
+static Cell* parse_tree(Input* in, CellAllocator alloc, Cell* pre[],
+                        uint32_t* id, PieceCursor* pieces) {
+  Cell* stack = NULL;
+  Cell* e;
+  do {
+    if (pieces && pieces->next < pieces->end &&
+        in->ptr == pieces->text + pieces->next->start) {
+      ParsePiece* piece = pieces->next++;
+      e = piece->cell;
+      in->ptr = pieces->text + piece->end;
+      *id += piece->nodes;
+    } else {
+      e = parse_token(in, alloc, pre);
+    }
+    if (!e) {
+      stack = alloc(AP, NULL, stack);
+      stack->id = ++*id;
+      continue;
+    }
+    while (stack) {
+      if (!stack->l) {
+        stack->l = e;
+        break;
+      }
+      Cell* next = stack->r;
+      stack->r = e;
+      e = stack;
+      stack = next;
+    }
+  } while (stack);
+  return e;
+}
+
+static Cell* parse(Input* in) {
+  Cell* pre[NUM_CELL_TYPES];
+  parse_builtins(pre, allocate_from_old);
+  return parse_tree(in, allocate_from_old, pre, &num_nodes, NULL);
+}
+
+// If both program and input are from stdin, discards the rest of the
+// current line, for convenience.
+static void skip_program_line(Input* in) {
+  int ch;
+  do {
+    ch = read_program_char(in);
+  } while (ch != EOF && ch != '\n');
+}
+
+// Byte classes for the scans of the program text.
+enum { SCAN_BAD, SCAN_SPACE, SCAN_COMMENT, SCAN_BACKQUOTE, SCAN_LEAF, SCAN_CHAR };
+
+static const uint8_t scan_class[256] = {
+  [' '] = SCAN_SPACE, ['\t'] = SCAN_SPACE, ['\n'] = SCAN_SPACE,
+  ['\v'] = SCAN_SPACE, ['\f'] = SCAN_SPACE, ['\r'] = SCAN_SPACE,
+  ['#'] = SCAN_COMMENT, ['`'] = SCAN_BACKQUOTE,
+  ['i'] = SCAN_LEAF, ['I'] = SCAN_LEAF, ['k'] = SCAN_LEAF, ['K'] = SCAN_LEAF,
+  ['s'] = SCAN_LEAF, ['S'] = SCAN_LEAF, ['v'] = SCAN_LEAF, ['V'] = SCAN_LEAF,
+  ['d'] = SCAN_LEAF, ['D'] = SCAN_LEAF, ['c'] = SCAN_LEAF, ['C'] = SCAN_LEAF,
+  ['e'] = SCAN_LEAF, ['E'] = SCAN_LEAF, ['r'] = SCAN_LEAF, ['R'] = SCAN_LEAF,
+  ['@'] = SCAN_LEAF, ['|'] = SCAN_LEAF, ['.'] = SCAN_CHAR, ['?'] = SCAN_CHAR,
+  ['$'] = SCAN_CHAR,
+};
+
+// Bits (1 << type) of the builtins other than s, k, i, v and r.
+static const uint32_t scan_types[256] = {
+  ['d'] = 1u << D, ['D'] = 1u << D, ['c'] = 1u << C, ['C'] = 1u << C,
+  ['e'] = 1u << E, ['E'] = 1u << E, ['@'] = 1u << AT, ['|'] = 1u << PIPE,
+  ['?'] = 1u << QUES,
+};
+
+// Skips whitespace and comments from *p, and then a token. Returns true if
+// it is a backquote. The scan_types bits of a builtin are added to *types.
+static inline bool scan_token(const uint8_t* text, size_t len, size_t* p,
+                              uint32_t* types) {
+  size_t i = *p;
+  for (;; i++) {
+    if (i >= len)
+      errexit("unexpected EOF\n");
+    int cls = scan_class[text[i]];
+    if (cls == SCAN_BACKQUOTE) {
+      *p = i + 1;
+      return true;
+    }
+    if (cls >= SCAN_LEAF)
+      break;
+    if (cls == SCAN_COMMENT) {
+      while (i + 1 < len && text[i + 1] != '\n')
+        i++;
+    } else if (cls == SCAN_BAD) {
+      errexit("unexpected character %c\n", text[i]);
+    }
+  }
+  *types |= scan_types[text[i]];
+  if (scan_class[text[i]] == SCAN_CHAR && ++i >= len)
+    errexit("unexpected EOF\n");
+  *p = i + 1;
+  return false;
+}
+
+// With -j, the program file is parsed by several threads. A first pass
+// only counts backquotes and operands, to find pieces: subtrees of
+// between PARSE_PIECE_MIN and piece_size bytes whose parent is larger.
+// Worker threads parse the pieces into chunks of their own, which then
+// join the old generation, and the rest of the tree is parsed with every
+// piece taken as a single token. Long spines of small subtrees (such as
+// ``k<P1>``k<P2>... with small Pn) leave few pieces, and are mostly parsed
+// by that last step.
+#define PARSE_PIECES_PER_THREAD 8
+#define PARSE_PIECE_MIN (4*1024)
+
+static int parse_threads = 1;
+static double parse_time;  // of the program file, in seconds
+
+static double wall_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  size_t pos, right_pos;  // backquote, and start of the right child
+  uint32_t id, right_id;  // node ids of the same
+} ScanFrame;
+
+typedef struct {
+  ParsePiece* pieces;
+  int n, size;
+  size_t piece_size;
+} PieceList;
+
+static void add_piece(PieceList* list, size_t start, size_t end,
+                      uint32_t first_id, uint32_t nodes) {
+  if (!nodes || end - start < PARSE_PIECE_MIN || end - start > list->piece_size)
+    return;
+  if (list->n == list->size) {
+    list->size = list->size ? list->size * 2 : 64;
+    list->pieces = realloc(list->pieces, sizeof(ParsePiece) * list->size);
+    if (!list->pieces)
+      errexit("Out of memory\n");
+  }
+  ParsePiece piece = {start, end, first_id, nodes, NULL};
+  list->pieces[list->n++] = piece;
+}
+
+static int compare_pieces(const void* a, const void* b) {
+  size_t x = ((const ParsePiece*)a)->start, y = ((const ParsePiece*)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+// Checks the syntax of the program and collects its pieces, in text order.
+static void scan_pieces(const uint8_t* text, size_t len, PieceList* list) {
+  ScanFrame* stack = NULL;
+  size_t sp = 0, stack_size = 0, p = 0;
+  uint32_t id = 0, types = 0;
+  for (;;) {
+    if (scan_token(text, len, &p, &types)) {
+      if (sp == stack_size) {
+        stack_size = stack_size ? stack_size * 2 : 1024;
+        stack = realloc(stack, sizeof(ScanFrame) * stack_size);
+        if (!stack)
+          errexit("Out of memory\n");
+      }
+      ScanFrame f = {p - 1, 0, ++id, 0};
+      stack[sp++] = f;
+      continue;
+    }
+    // A subtree is complete. Pieces are the children of larger subtrees.
+    while (sp) {
+      ScanFrame* f = &stack[sp - 1];
+      if (!f->right_pos) {
+        f->right_pos = p;
+        f->right_id = id + 1;
+        break;
+      }
+      if (p - f->pos > list->piece_size) {
+        add_piece(list, f->pos + 1, f->right_pos, f->id + 1,
+                  f->right_id - f->id - 1);
+        add_piece(list, f->right_pos, p, f->right_id, id + 1 - f->right_id);
+      }
+      sp--;
+    }
+    if (!sp)
+      break;
+  }
+  free(stack);
+  qsort(list->pieces, list->n, sizeof(ParsePiece), compare_pieces);
+}
+
+typedef struct {
+  pthread_t thread;
+  HeapChunk* chunks;
+  HeapChunk* current[2];  // chunks being filled: large, small
+  size_t used[2];
+} ParseWorker;
+
+static pthread_mutex_t parse_lock = PTHREAD_MUTEX_INITIALIZER;
+static const uint8_t* parse_text;
+static PieceList parse_pieces;
+static int parse_next_piece;
+static Cell* parse_pre[NUM_CELL_TYPES];
+static __thread ParseWorker* parse_worker;
+
+static Cell* parse_worker_alloc(CellType t, Cell* l, Cell* r) {
+  ParseWorker* w = parse_worker;
+  size_t size = cell_size(t);
+  int small = size == SMALL_CELL_SIZE;
+  HeapChunk* chunk = w->current[small];
+  if (!chunk || w->used[small] == chunk->size) {
+    // new_chunk() may extend the spill file.
+    pthread_mutex_lock(&parse_lock);
+    chunk = new_chunk(size, heap_chunk_size);
+    pthread_mutex_unlock(&parse_lock);
+    chunk->next = w->chunks;
+    w->chunks = w->current[small] = chunk;
+    w->used[small] = 0;
+  }
+  Cell* c = chunk_cell(chunk, w->used[small]++);
+  c->t = t;
+  c->marked = false;
+  c->id = 0;
+  c->l = l;
+  if (size == LARGE_CELL_SIZE)
+    c->r = r;
+  return c;
+}
+
+static void* parse_worker_main(void* arg) {
+  parse_worker = arg;
+  for (;;) {
+    pthread_mutex_lock(&parse_lock);
+    int i = parse_next_piece++;
+    pthread_mutex_unlock(&parse_lock);
+    if (i >= parse_pieces.n)
+      break;
+    ParsePiece* piece = &parse_pieces.pieces[i];
+    Input in;
+    input_from_memory(&in, parse_text + piece->start, piece->end - piece->start);
+    // Numbered as by the sequential parser, as memo slots and tier counters
+    // are indexed by node id.
+    uint32_t id = piece->first_id - 1;
+    piece->cell = parse_tree(&in, parse_worker_alloc, parse_pre, &id, NULL);
+  }
+  return NULL;
+}
+
+static Cell* parse_parallel(const uint8_t* text, size_t len) {
+  parse_text = text;
+  parse_pieces.piece_size = len / (parse_threads * PARSE_PIECES_PER_THREAD);
+  scan_pieces(text, len, &parse_pieces);
+  parse_builtins(parse_pre, allocate_from_old);
+
+  ParseWorker* workers = calloc(parse_threads, sizeof(ParseWorker));
+  if (!workers)
+    errexit("Out of memory\n");
+  for (int i = 1; i < parse_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, parse_worker_main,
+                       &workers[i]) != 0)
+      errexit("cannot create parser thread\n");
+  }
+  parse_worker_main(&workers[0]);
+  for (int i = 0; i < parse_threads; i++) {
+    if (i > 0)
+      pthread_join(workers[i].thread, NULL);
+    for (HeapChunk *chunk = workers[i].chunks, *next; chunk; chunk = next) {
+      next = chunk->next;
+      int small = chunk->cell_size == SMALL_CELL_SIZE;
+      add_chunk(chunk, chunk == workers[i].current[small]
+                ? workers[i].used[small] : chunk->size);
+    }
+  }
+  free(workers);
+
+  Input in;
+  input_from_memory(&in, text, len);
+  PieceCursor cursor = {text, parse_pieces.pieces,
+                        parse_pieces.pieces + parse_pieces.n};
+  Cell* root = parse_tree(&in, allocate_from_old, parse_pre, &num_nodes,
+                          &cursor);
+  free(parse_pieces.pieces);
+  return root;
+}
+
+static Cell* load_program(const char* fname, Input* stdin_in) {
+  if (fname == NULL) {
+    Cell* c = parse(stdin_in);
+    tier_init();
+    skip_program_line(stdin_in);
+    return c;
+  }
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    errexit("cannot open %s\n", fname);
+  double start = wall_time();
+  Cell* c;
+  if (parse_threads > 1) {
+    size_t len;
+    uint8_t* text = read_all(fd, &len);
+    c = parse_parallel(text, len);
+    free(text);
+  } else {
+    Input in;
+    input_from_fd(&in, fd);
+    c = parse(&in);
+    input_close(&in);
+  }
+  parse_time += wall_time() - start;
+  close(fd);
+  tier_init();
+  return c;
+}
+
+static bool same_tree(Cell* a, Cell* b) {
+  while (a->t == AP && b->t == AP) {
+    if (!same_tree(a->l, b->l))
+      return false;
+    a = a->r;
+    b = b->r;
+  }
+  if (a->t != b->t)
+    return false;
+  return (a->t != DOT && a->t != QUES && a->t != EXT) || a->ch == b->ch;
+}
+
+// Returns the EXT cell of a combinator whose pattern is the tree c, or NULL.
+static Cell* match_pattern(Cell* c, Cell* patterns[], Cell* cells[], int n) {
+  for (int i = 0; i < n; i++) {
+    if (same_tree(c, patterns[i]))
+      return cells[i];
+  }
+  return NULL;
+}
+
+// Replaces the subtrees of the program that are equal to the pattern of an
+// extension combinator with the combinator, and returns the new root.
+static Cell* bind_extensions(Cell* root) {
+  Cell* patterns[256];
+  Cell* cells[256];
+  int n = 0;
+  Cell* pre[NUM_CELL_TYPES];
+  parse_builtins(pre, allocate_from_old);
+  for (int name = 0; name < 256; name++) {
+    if (!extensions[name].pattern)
+      continue;
+    Input in;
+    input_from_memory(&in, (const uint8_t*)extensions[name].pattern,
+                      strlen(extensions[name].pattern));
+    uint32_t id = 0;  // not program nodes
+    patterns[n] = parse_tree(&in, allocate_from_old, pre, &id, NULL);
+    cells[n] = allocate_from_old(EXT, NULL, NULL);
+    cells[n]->ch = name;
+    n++;
+  }
+  if (!n)
+    return root;
+
+  Cell* x = match_pattern(root, patterns, cells, n);
+  if (x) {
+    ext_subtrees++;
+    return x;
+  }
+  int stack_size = INITIAL_MARK_STACK_SIZE, sp = 0;
+  Cell** stack = malloc(sizeof(Cell*) * stack_size);
+  if (!stack)
+    errexit("Out of memory\n");
+  stack[sp++] = root;
+  while (sp) {
+    Cell* c = stack[--sp];
+    if (c->t != AP)
+      continue;
+    if (sp + 2 > stack_size) {
+      stack_size *= 2;
+      stack = realloc(stack, sizeof(Cell*) * stack_size);
+      if (!stack)
+        errexit("Out of memory\n");
+    }
+    Cell** children[2] = {&c->r, &c->l};
+    for (int i = 0; i < 2; i++) {
+      if ((x = match_pattern(*children[i], patterns, cells, n))) {
+        *children[i] = x;
+        ext_subtrees++;
+      } else {
+        stack[sp++] = *children[i];
+      }
+    }
+  }
+  free(stack);
+  return root;
+}
+
+// With --lazy, the program file is only scanned before running: the scan
+// records, for every AP node (numbered in the order of their backquotes,
+// as parse() does), where it and its right child start. The root is a LAZY
+// cell, which the evaluator expands in place into an AP node when it first
+// reaches it; children that are AP nodes become LAZY cells in turn. Parts
+// of the program that a run never reaches are never allocated.
+
+typedef struct {
+  uint32_t pos;        // offset of the backquote
+  uint32_t right_pos;  // offset where the right child starts
+  uint32_t right_id;   // node id of the right child, if it is an AP node
+} LazyNode;
+
+static const uint8_t* lazy_text;
+static size_t lazy_len;
+static LazyNode* lazy_nodes;   // indexed by node id
+static uint32_t lazy_types;    // bit 1 << t for every builtin type t used
+static long lazy_expanded;
+
+// Checks the syntax of the program and fills lazy_nodes.
+static void lazy_scan() {
+  uint32_t* stack = NULL;  // open AP nodes
+  size_t sp = 0, stack_size = 0, nodes_size = 0;
+  size_t p = 0;
+  for (;;) {
+    if (scan_token(lazy_text, lazy_len, &p, &lazy_types)) {
+      if (++num_nodes >= nodes_size) {
+        nodes_size = nodes_size ? nodes_size * 2 : 1024;
+        lazy_nodes = realloc(lazy_nodes, sizeof(LazyNode) * nodes_size);
+        if (!lazy_nodes)
+          errexit("Out of memory\n");
+      }
+      if (sp == stack_size) {
+        stack_size = stack_size ? stack_size * 2 : 1024;
+        stack = realloc(stack, sizeof(uint32_t) * stack_size);
+        if (!stack)
+          errexit("Out of memory\n");
+      }
+      lazy_nodes[num_nodes].pos = p - 1;
+      lazy_nodes[num_nodes].right_pos = 0;
+      stack[sp++] = num_nodes;
+      continue;
+    }
+    // A subtree is complete.
+    while (sp) {
+      LazyNode* node = &lazy_nodes[stack[sp - 1]];
+      if (!node->right_pos) {
+        node->right_pos = p;
+        node->right_id = num_nodes + 1;
+        break;
+      }
+      sp--;
+    }
+    if (!sp)
+      break;
+  }
+  free(stack);
+}
+
+// Returns the cell for the subtree starting at pos: a LAZY cell for the AP
+// node id, or a builtin.
+static Cell* lazy_child(uint32_t pos, uint32_t id) {
+  Input in;
+  input_from_memory(&in, lazy_text + pos, lazy_len - pos);
+  Cell* c = parse_token(&in, allocate_from_old, lazy_builtins);
+  if (!c) {
+    c = allocate_from_old(LAZY, NULL, NULL);
+    c->id = id;
+  }
+  return c;
+}
+
+// Called by the evaluator.
+static void lazy_expand(Cell* c) {
+  LazyNode* node = &lazy_nodes[c->id];
+  c->t = AP;
+  c->l = lazy_child(node->pos + 1, c->id + 1);
+  c->r = lazy_child(node->right_pos, node->right_id);
+  lazy_expanded++;
+}
+
+static Cell* load_program_lazy(const char* fname) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    errexit("cannot open %s\n", fname);
+  lazy_text = read_all(fd, &lazy_len);
+  close(fd);
+  if (lazy_len > UINT32_MAX)
+    errexit("%s is too large for --lazy\n", fname);
+  lazy_scan();
+  tier_init();
+  parse_builtins(lazy_builtins, allocate_from_old);
+  return lazy_child(0, 1);
+}
+
+// With -p, the program is parsed by a separate thread while it runs. Every
+// PIPELINE_TOKENS tokens, the parser publishes the part of the tree it has
+// read: the open AP nodes get cells, and a child that is not complete yet
+// is a HOLE cell, which the parser fills in (l: the child) when it is done.
+// The evaluator waits when it reaches an unfilled HOLE. Published cells are
+// not modified afterwards, and holes are only accessed under
+// pipeline_lock. The parser allocates from blocks of its own, with the
+// cells marked permanently (as for the program shared by sessions), so the
+// GC neither traces nor frees them.
+#define PIPELINE_TOKENS (64*1024)
+#define PIPELINE_BLOCK_SIZE (1024*1024)
+
+typedef struct {
+  Cell* cell;   // published AP cell, or NULL
+  Cell* l;      // left child, once complete
+  bool has_l;
+  Cell* hole;   // HOLE in cell for the child being parsed, if any
+  Cell* rhole;  // HOLE in cell for the right child
+} ParseFrame;
+
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_cond = PTHREAD_COND_INITIALIZER;
+static Cell* pipeline_root;
+static bool pipeline_done;
+static char *pipeline_ptr, *pipeline_end;  // parser's allocation block
+
+static Cell* pipeline_alloc(CellType t, Cell* l, Cell* r) {
+  size_t size = cell_size(t);
+  if (pipeline_ptr + size > pipeline_end) {
+    pipeline_ptr = malloc(PIPELINE_BLOCK_SIZE);
+    if (!pipeline_ptr)
+      errexit("Out of memory\n");
+    pipeline_end = pipeline_ptr + PIPELINE_BLOCK_SIZE;
+  }
+  Cell* c = (Cell*)pipeline_ptr;
+  pipeline_ptr += size;
+  c->t = t;
+  c->marked = true;
+  c->id = 0;
+  c->l = l;
+  if (size == LARGE_CELL_SIZE)
+    c->r = r;
+  return c;
+}
+
+static void pipeline_fill(Cell* hole, Cell* c) {
+  pthread_mutex_lock(&pipeline_lock);
+  hole->l = c;
+  pthread_cond_broadcast(&pipeline_cond);
+  pthread_mutex_unlock(&pipeline_lock);
+}
+
+// Called by the evaluator. Returns the cell of a hole, after flushing out
+// and waiting for the parser if it is not filled yet.
+static Cell* pipeline_wait(Cell* hole, Output* out) {
+  pthread_mutex_lock(&pipeline_lock);
+  if (!hole->l) {
+    pthread_mutex_unlock(&pipeline_lock);
+    output_flush(out);
+    pthread_mutex_lock(&pipeline_lock);
+    while (!hole->l)
+      pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+  }
+  Cell* c = hole->l;
+  pthread_mutex_unlock(&pipeline_lock);
+  return c;
+}
+
+// Gives cells to the open frames that have none, innermost first, and
+// links them to the innermost frame published before.
+static void pipeline_publish(ParseFrame* frames, size_t n) {
+  Cell* child = NULL;
+  for (size_t i = n; i-- > 0;) {
+    ParseFrame* f = &frames[i];
+    if (f->cell) {
+      if (child) {
+        pipeline_fill(f->hole, child);
+        f->hole = NULL;
+      }
+      return;
+    }
+    Cell* hole = child ? NULL : pipeline_alloc(HOLE, NULL, NULL);
+    Cell* slot = child ? child : hole;
+    if (f->has_l) {
+      f->cell = pipeline_alloc(AP, f->l, slot);
+    } else {
+      f->rhole = pipeline_alloc(HOLE, NULL, NULL);
+      f->cell = pipeline_alloc(AP, slot, f->rhole);
+    }
+    f->hole = hole;
+    child = f->cell;
+  }
+  if (child) {
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_root = child;
+    pthread_cond_broadcast(&pipeline_cond);
+    pthread_mutex_unlock(&pipeline_lock);
+  }
+}
+
+typedef struct {
+  Input* in;
+  bool from_stdin;
+} PipelineArgs;
+
+static void* pipeline_parse(void* arg) {
+  PipelineArgs* args = arg;
+  Input* in = args->in;
+  Cell* pre[NUM_CELL_TYPES];
+  parse_builtins(pre, pipeline_alloc);
+
+  ParseFrame* frames = NULL;
+  size_t nframes = 0, frames_size = 0;
+  long tokens = 0;
+  Cell* e;
+  do {
+    if (++tokens % PIPELINE_TOKENS == 0)
+      pipeline_publish(frames, nframes);
+    e = parse_token(in, pipeline_alloc, pre);
+    if (!e) {
+      if (nframes == frames_size) {
+        frames_size = frames_size ? frames_size * 2 : 1024;
+        frames = realloc(frames, sizeof(ParseFrame) * frames_size);
+        if (!frames)
+          errexit("Out of memory\n");
+      }
+      memset(&frames[nframes++], 0, sizeof(ParseFrame));
+      continue;
+    }
+    while (nframes) {
+      ParseFrame* f = &frames[nframes - 1];
+      if (f->hole)
+        pipeline_fill(f->hole, e);
+      if (!f->has_l) {
+        f->l = e;
+        f->has_l = true;
+        f->hole = f->rhole;
+        break;
+      }
+      e = f->cell ? f->cell : pipeline_alloc(AP, f->l, e);
+      nframes--;
+    }
+  } while (nframes);
+  free(frames);
+
+  if (args->from_stdin) {
+    skip_program_line(in);
+  } else {
+    close(in->fd);
+    input_close(in);
+    free(in);
+  }
+  free(args);
+  pthread_mutex_lock(&pipeline_lock);
+  if (!pipeline_root)
+    pipeline_root = e;
+  pipeline_done = true;
+  pthread_cond_broadcast(&pipeline_cond);
+  pthread_mutex_unlock(&pipeline_lock);
+  return NULL;
+}
+
+// Until the parser is done, the evaluator reads stdin through an input that
+// waits for it and then takes over the parser's buffer.
+static long pipeline_input_fill(Input* in) {
+  Input* src = in->ctx;
+  pthread_mutex_lock(&pipeline_lock);
+  while (!pipeline_done)
+    pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+  pthread_mutex_unlock(&pipeline_lock);
+  Output* tie = in->tie;
+  *in = *src;
+  in->tie = tie;
+  free(src);
+  return in->ptr < in->end ? in->end - in->ptr : in->fill(in);
+}
+
+// Starts parsing the program on a thread, and returns its root as soon as
+// it is published.
+static Cell* load_program_pipelined(const char* fname, Input* stdin_in) {
+  PipelineArgs* args = malloc(sizeof(PipelineArgs));
+  Input* in = malloc(sizeof(Input));
+  if (!args || !in)
+    errexit("Out of memory\n");
+  if (fname == NULL) {
+    // The output belongs to the evaluator, so the parser does not flush it.
+    Output* tie = stdin_in->tie;
+    *in = *stdin_in;
+    in->tie = NULL;
+    memset(stdin_in, 0, sizeof(Input));
+    stdin_in->fill = pipeline_input_fill;
+    stdin_in->ctx = in;
+    stdin_in->tie = tie;
+  } else {
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+      errexit("cannot open %s\n", fname);
+    input_from_fd(in, fd);
+  }
+  args->in = in;
+  args->from_stdin = fname == NULL;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pipeline_parse, args) != 0)
+    errexit("cannot create parser thread\n");
+  pthread_detach(thread);
+
+  pthread_mutex_lock(&pipeline_lock);
+  while (!pipeline_root)
+    pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+  Cell* root = pipeline_root;
+  pthread_mutex_unlock(&pipeline_lock);
+  tier_init();
+  return root;
+}
+
+// Waits for the parser to finish reading stdin.
+static void pipeline_finish(Input* stdin_in) {
+  if (stdin_in->fill == pipeline_input_fill)
+    pipeline_input_fill(stdin_in);
+}
+
+// Lambda terms --------------------------------------------------------
+
+// With -l, subtrees of the program that build functions out of s, k and i
+// are translated back into lambda terms, which run() evaluates with an
+// environment machine instead of combinator reduction. Compiled Unlambda
+// programs are bracket-abstracted lambda terms, so this undoes the
+// abstraction for the functions they define.
+//
+// Only subtrees whose evaluation has no effects are translated: partial
+// applications of s and k, and applications of i, `kx and d, whose operands
+// are such subtrees themselves. Everything else stays a combinator
+// expression, so effects happen in the original order.
+//
+// Terms use de Bruijn indices:
+//
+//   LAM    l: body
+//   LAPP   l: operator, r: operand
+//   VAR    id: index
+//   CONST  l: value
+//
+// At run time, a TERM cell (l: term, r: environment) is an expression, a
+// CLOSURE (l: LAM, r: environment) is a function value, and an environment
+// is a list of ENV cells (l: value, r: next).
+
+#define LAMBDA_FUEL 100000     // term nodes visited per translated subtree
+#define LAMBDA_MAX_DEPTH 1000  // recursion depth
+
+static long lambda_fuel;
+static bool lambda_exhausted;  // a translation ran out of fuel or depth
+static long lambda_subtrees;
+
+// Translations of program AP nodes by id; &no_term if not translatable.
+static Cell** lambda_memo;
+static Cell no_term;
+
+static bool out_of_fuel(int depth) {
+  if (--lambda_fuel < 0 || depth > LAMBDA_MAX_DEPTH)
+    lambda_exhausted = true;
+  return lambda_exhausted;
+}
+
+static Cell* mk_lam(Cell* body) {
+  return body ? allocate_from_old(LAM, body, NULL) : NULL;
+}
+
+static Cell* mk_app(Cell* f, Cell* a) {
+  return f && a ? allocate_from_old(LAPP, f, a) : NULL;
+}
+
+static Cell* mk_var(uint32_t index) {
+  Cell* c = allocate_from_old(VAR, NULL, NULL);
+  c->id = index;
+  return c;
+}
+
+static Cell* mk_const(Cell* value) {
+  return allocate_from_old(CONST, value, NULL);
+}
+
+// Adds d to the indices of the variables of m that are free at cutoff.
+static Cell* shift(Cell* m, uint32_t d, uint32_t cutoff, int depth) {
+  if (!m || out_of_fuel(depth))
+    return NULL;
+  switch (m->t) {
+  case VAR:
+    return m->id >= cutoff ? mk_var(m->id + d) : m;
+  case LAM:
+    return mk_lam(shift(m->l, d, cutoff + 1, depth + 1));
+  case LAPP:
+    return mk_app(shift(m->l, d, cutoff, depth + 1),
+                  shift(m->r, d, cutoff, depth + 1));
+  default:
+    return m;
+  }
+}
+
+// Substitutes v for variable k in m, removing the binder of k.
+static Cell* subst(Cell* m, uint32_t k, Cell* v, int depth) {
+  if (!m || out_of_fuel(depth))
+    return NULL;
+  switch (m->t) {
+  case VAR:
+    return m->id == k ? shift(v, k, 0, depth + 1)
+      : m->id > k ? mk_var(m->id - 1) : m;
+  case LAM:
+    return mk_lam(subst(m->l, k + 1, v, depth + 1));
+  case LAPP:
+    return mk_app(subst(m->l, k, v, depth + 1), subst(m->r, k, v, depth + 1));
+  default:
+    return m;
+  }
+}
+
+// Counts the occurrences of variable k in m, up to 2.
+static int uses(Cell* m, uint32_t k, int depth) {
+  if (depth > LAMBDA_MAX_DEPTH)
+    return 2;
+  switch (m->t) {
+  case VAR:
+    return m->id == k;
+  case LAM:
+    return uses(m->l, k + 1, depth + 1);
+  case LAPP:
+    {
+      int n = uses(m->l, k, depth + 1);
+      return n >= 2 ? n : n + uses(m->r, k, depth + 1);
+    }
+  default:
+    return 0;
+  }
+}
+
+// Beta-reduces redexes whose operand is a value. A lambda operand is only
+// substituted if it is used at most once, so that terms do not grow.
+static Cell* normalize(Cell* m, int depth) {
+  if (!m || out_of_fuel(depth))
+    return NULL;
+  switch (m->t) {
+  case LAM:
+    return mk_lam(normalize(m->l, depth + 1));
+  case LAPP:
+    {
+      Cell* f = normalize(m->l, depth + 1);
+      Cell* a = normalize(m->r, depth + 1);
+      if (!f || !a)
+        return NULL;
+      if (f->t == LAM && a->t != LAPP &&
+          (a->t != LAM || uses(f->l, 0, depth) <= 1))
+        return normalize(subst(f->l, 0, a, depth + 1), depth + 1);
+      return mk_app(f, a);
+    }
+  default:
+    return m;
+  }
+}
+
+static Cell* translate_ap(Cell* c, int depth);
+
+// Translates a program subtree to a closed term, or returns NULL if the
+// subtree is not a pure function definition.
+static Cell* translate(Cell* c, int depth) {
+  if (out_of_fuel(depth))
+    return NULL;
+  if (is_value(c)) {
+    switch (c->t) {
+    case I:  // \x.x
+      return mk_lam(mk_var(0));
+    case K:  // \x.\y.x
+      return mk_lam(mk_lam(mk_var(1)));
+    case S:  // \x.\y.\z.xz(yz)
+      return mk_lam(mk_lam(mk_lam(
+        mk_app(mk_app(mk_var(2), mk_var(0)), mk_app(mk_var(1), mk_var(0))))));
+    default:
+      return mk_const(c);
+    }
+  }
+  Cell* m = lambda_memo[c->id];
+  if (m)
+    return m == &no_term ? NULL : m;
+  m = translate_ap(c, depth);
+  if (m || !lambda_exhausted)
+    lambda_memo[c->id] = m ? m : &no_term;
+  return m;
+}
+
+static Cell* translate_ap(Cell* c, int depth) {
+  if (c->l->t == D)
+    return mk_const(allocate_from_old(D1, c->r, NULL));
+  Cell* f = translate(c->l, depth + 1);
+  if (!f || f->t != LAM)
+    return NULL;
+  // An operand that is not a value is a computation, which may have effects
+  // or not terminate: substituting it would drop or duplicate it.
+  Cell* a = translate(c->r, depth + 1);
+  if (!a || a->t == LAPP)
+    return NULL;
+  return normalize(subst(f->l, 0, a, depth + 1), depth + 1);
+}
+
+// Replaces closed lambda subterms with constant closures, so that they are
+// not allocated again at every evaluation. *fv is set to the largest free
+// variable index, or -1.
+static Cell* close_term(Cell* m, int* fv, int depth) {
+  switch (m->t) {
+  case VAR:
+    *fv = m->id;
+    return m;
+  case LAM:
+    {
+      int body_fv;
+      Cell* lam = mk_lam(close_term(m->l, &body_fv, depth + 1));
+      *fv = body_fv > 0 ? body_fv - 1 : -1;
+      if (*fv < 0 && depth > 0)
+        return mk_const(allocate_from_old(CLOSURE, lam, NULL));
+      return lam;
+    }
+  case LAPP:
+    {
+      int fv_l, fv_r;
+      Cell* l = close_term(m->l, &fv_l, depth + 1);
+      Cell* r = close_term(m->r, &fv_r, depth + 1);
+      *fv = fv_l > fv_r ? fv_l : fv_r;
+      return mk_app(l, r);
+    }
+  default:
+    *fv = -1;
+    return m;
+  }
+}
+
+// Returns a value equivalent to the program subtree, or NULL.
+static Cell* recover_value(Cell* c) {
+  lambda_fuel = LAMBDA_FUEL;
+  lambda_exhausted = false;
+  Cell* m = translate(c, 0);
+  if (!m)
+    return NULL;
+  int fv;
+  m = close_term(m, &fv, 0);
+  if (m->t == LAM)
+    return allocate_from_old(CLOSURE, m, NULL);
+  return m->t == CONST ? m->l : NULL;
+}
+
+// Replaces every maximal translatable subtree of the program with its
+// value.
+static void recover_lambdas(Cell* root) {
+  lambda_memo = calloc(num_nodes + 1, sizeof(Cell*));
+  if (!lambda_memo)
+    errexit("Out of memory\n");
+  int stack_size = INITIAL_MARK_STACK_SIZE, sp = 0;
+  Cell** stack = malloc(sizeof(Cell*) * stack_size);
+  if (!stack)
+    errexit("Out of memory\n");
+  stack[sp++] = root;
+  while (sp) {
+    Cell* c = stack[--sp];
+    if (c->t == D1) {
+      // The promise made by translating `d<x>
+      c = c->l;
+    }
+    if (c->t != AP)
+      continue;
+    if (sp + 2 > stack_size) {
+      stack_size *= 2;
+      stack = realloc(stack, sizeof(Cell*) * stack_size);
+      if (!stack)
+        errexit("Out of memory\n");
+    }
+    Cell** children[2] = {&c->l, &c->r};
+    for (int i = 0; i < 2; i++) {
+      Cell* child = *children[i];
+      Cell* v = child->t == AP ? recover_value(child) : NULL;
+      if (v) {
+        *children[i] = v;
+        lambda_subtrees++;
+      }
+      stack[sp++] = v ? v : child;
+    }
+  }
+  free(stack);
+  free(lambda_memo);
+}
+
+// Evaluator -----------------------------------------------------------
+
+#define PUSHCONT(t, v) (next_cont = new_cell(task, next_cont, task_val), task = t, task_val = v)
+#define POPCONT (task = next_cont->t, task_val = next_cont->r, next_cont = next_cont->l)
+
+// True if the continuation (t, v) applies the result to an argument that is
+// already a value, so that a combinator can consume the argument right away
+// instead of returning a partial application.
+#define PENDING_ARG(t, v) ((t) == APPLY_T || ((t) == EVAL_RIGHT && is_value(v)))
+
+// Forcing a promise `d<x> evaluates x, which is a program node unless the
+// promise was made at run time. Program subtrees are closed, so if one
+// evaluation of a node has no effects, all of them give the same value,
+// which can then be reused. The evaluator counts the operations that have
+// effects or depend on more than their operands (., @, ?, |, c, invoking a
+// continuation, and native combinators), and a MEMO continuation (r: the
+// node) keeps the value of the node if the count has not changed since the
+// forcing started. An evaluation that never finishes is never memoized.
+// Memoization is off (memo_slot is NULL) when several instances share the
+// program, as their values live in different old generations.
+
+static uint64_t applications;  // done by run()
+static uint64_t effect_count;
+static uint32_t* memo_slot;   // by node id, index into memo_values plus one
+static uint64_t* memo_start;  // by node id, effect_count when last forced
+static uint64_t memo_hits;
+
+static void memo_init() {
+  memo_slot = calloc(num_nodes + 1, sizeof(uint32_t));
+  memo_start = calloc(num_nodes + 1, sizeof(uint64_t));
+  if (!memo_slot || !memo_start)
+    errexit("Out of memory\n");
+}
+
+// Returns the memoized value of the program node x, or NULL.
+static inline Cell* memo_lookup(Cell* x) {
+  uint32_t slot = memo_slot[x->id];
+  return slot ? memo_values.cells[slot - 1] : NULL;
+}
+
+static inline void memo_begin(Cell* x) {
+  memo_start[x->id] = effect_count;
+}
+
+// Called when the forcing of x has given val.
+static void memo_end(Cell* x, Cell* val) {
+  if (memo_start[x->id] != effect_count || memo_slot[x->id])
+    return;
+  cell_list_push(&memo_values, val);
+  memo_slot[x->id] = memo_values.n;
+}
+
+// Registers of the evaluator. run() works on local copies and writes them
+// back when it suspends.
+typedef struct {
+  Cell* val;
+  Cell* op;  // if non-NULL, run() resumes by applying op to val
+  Cell* task_val;
+  Cell* next_cont;
+  CellType task;
+  int current_ch;
+  Input* in;
+  Output* out;
+  int features;  // FEATURE_* flags selecting the evaluator
+  uint64_t slice;  // if non-zero, run() yields at the first GC after this
+                   // many applications
+} RunState;
+
+typedef enum {
+  RUN_EXIT,
+  RUN_SUSPENDED,  // @ found no input available, or . no room for output
+  RUN_YIELDED,    // the slice has been used up
+} RunStatus;
+
+static void run_init(RunState* st, Cell* program, int features,
+                     Input* in, Output* out) {
+  memset(st, 0, sizeof(RunState));
+  st->val = program;
+  st->features = features;
+  st->task = EXIT;
+  st->current_ch = EOF;
+  st->in = in;
+  st->out = out;
+}
+
+// Builtins used by a program. The evaluator is compiled once for every
+// combination (see run.h), and run() picks the copy for the program.
+#define FEATURE_D 1   // d
+#define FEATURE_C 2   // c
+#define FEATURE_IO 4  // @, ? and |
+#define FEATURE_E 8   // e
+#define FEATURE_ALL 15
+
+#define RUN_NAME(features) RUN_NAME_(features)
+#define RUN_NAME_(features) run_##features
+
+#define RUN_FEATURES 0
+#include "run.h"
+#define RUN_FEATURES 1
+#include "run.h"
+#define RUN_FEATURES 2
+#include "run.h"
+#define RUN_FEATURES 3
+#include "run.h"
+#define RUN_FEATURES 4
+#include "run.h"
+#define RUN_FEATURES 5
+#include "run.h"
+#define RUN_FEATURES 6
+#include "run.h"
+#define RUN_FEATURES 7
+#include "run.h"
+#define RUN_FEATURES 8
+#include "run.h"
+#define RUN_FEATURES 9
+#include "run.h"
+#define RUN_FEATURES 10
+#include "run.h"
+#define RUN_FEATURES 11
+#include "run.h"
+#define RUN_FEATURES 12
+#include "run.h"
+#define RUN_FEATURES 13
+#include "run.h"
+#define RUN_FEATURES 14
+#include "run.h"
+#define RUN_FEATURES 15
+#include "run.h"
+
+static RunStatus (*const run_variants[FEATURE_ALL + 1])(RunState*) = {
+  run_0, run_1, run_2, run_3, run_4, run_5, run_6, run_7,
+  run_8, run_9, run_10, run_11, run_12, run_13, run_14, run_15,
+};
+
+static RunStatus run(RunState* st) {
+  return run_variants[st->features](st);
+}
+
+// Returns the FEATURE_* flags for the builtins found by lazy_scan().
+static int lazy_features() {
+  int features = 0;
+  if (lazy_types & (1u << D))
+    features |= FEATURE_D;
+  if (lazy_types & (1u << C))
+    features |= FEATURE_C;
+  if (lazy_types & ((1u << AT) | (1u << QUES) | (1u << PIPE)))
+    features |= FEATURE_IO;
+  if (lazy_types & (1u << E))
+    features |= FEATURE_E;
+  return features;
+}
+
+// Returns the FEATURE_* flags for the builtins that occur in the program.
+static int program_features(Cell* root) {
+  int features = 0;
+  int stack_size = INITIAL_MARK_STACK_SIZE, sp = 0;
+  Cell** stack = malloc(sizeof(Cell*) * stack_size);
+  if (!stack)
+    errexit("Out of memory\n");
+  stack[sp++] = root;
+  while (sp) {
+    Cell* c = stack[--sp];
+    while (c->t == AP) {
+      if (sp >= stack_size) {
+        stack_size *= 2;
+        stack = realloc(stack, sizeof(Cell*) * stack_size);
+        if (!stack)
+          errexit("Out of memory\n");
+      }
+      stack[sp++] = c->r;
+      c = c->l;
+    }
+    switch (c->t) {
+    case D: features |= FEATURE_D; break;
+    case C: features |= FEATURE_C; break;
+    case AT: case QUES: case PIPE: features |= FEATURE_IO; break;
+    case E: features |= FEATURE_E; break;
+    default: break;
+    }
+  }
+  free(stack);
+  return features;
+}
+
+// Sessions ------------------------------------------------------------
+
+// In --sessions mode, every connection to a Unix domain socket runs its own
+// instance of the loaded program. The program cells are shared, and each
+// session owns a private old generation made of small chunks. Only one
+// session runs at a time; when it suspends waiting for input, all its live
+// young cells are tenured so that the nursery is free for the next session,
+// and an idle session costs nothing but its old generation. Output is never
+// waited for: what the socket does not take stays in the session's buffer,
+// and a session whose buffer is full suspends like one waiting for input.
+// A session that computes without waiting yields after SESSION_SLICE
+// applications (at its next minor GC), and the sessions that can run take
+// turns, so that it does not hold up the others.
+
+#define SESSION_CHUNK_SIZE (4*1024-1)
+#define SESSION_SLICE (1 << 20)
+
+// Old generation of a program instance that runs in turns with others.
+typedef struct {
+  HeapChunk* old_area;
+  Cell* free_list;
+  Cell* free_list_small;
+} OldGeneration;
+
+typedef struct {
+  int fd;
+  Input in;
+  Output out;
+  RunState st;
+  OldGeneration old;
+  bool exited;  // the program has exited, its output may still be pending
+  bool yielded;  // the program can go on without input or output
+} Session;
+
+// Runs an instance on its old generation until it exits or suspends. When
+// it suspends, its live young cells are tenured.
+static RunStatus run_instance(RunState* st, OldGeneration* old) {
+  old_area = old->old_area;
+  free_list = old->free_list;
+  free_list_small = old->free_list_small;
+
+  RunStatus status = run(st);
+  if (status != RUN_EXIT) {
+    Cell* roots[4] = {st->val, st->op, st->task_val, st->next_cont};
+    gc_tenure_all(roots, 4);
+    st->val = roots[0];
+    st->op = roots[1];
+    st->task_val = roots[2];
+    st->next_cont = roots[3];
+  } else {
+    young_reset();
+  }
+
+  old->old_area = old_area;
+  old->free_list = free_list;
+  old->free_list_small = free_list_small;
+  old_area = NULL;
+  free_list = free_list_small = NULL;
+  return status;
+}
+
+// Reads from the non-blocking socket; the session suspends when it would
+// block.
+static long session_read(void* ctx, uint8_t* buf, size_t size) {
+  Session* s = ctx;
+  ssize_t n;
+  do {
+    n = read(s->fd, buf, size);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? INPUT_PENDING : 0;
+  return n;
+}
+
+// Writes as much of the buffer as the socket takes without blocking, and
+// keeps the rest. Output to a client that has gone is discarded.
+static void session_output_flush(Output* out) {
+  size_t len = out->ptr - out->buf, n = 0;
+  while (n < len) {
+    ssize_t w = write(out->fd, out->buf + n, len - n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        n = len;
+      break;
+    }
+    n += w;
+  }
+  memmove(out->buf, out->buf + n, len - n);
+  out->ptr = out->buf + (len - n);
+}
+
+static bool session_output_pending(Session* s) {
+  return s->out.ptr > s->out.buf;
+}
+
+// True if the session has suspended at a . because its buffer was full.
+static bool session_waits_for_output(Session* s) {
+  return !s->yielded && s->st.op && s->st.op->t == DOT;
+}
+
+// Runs the session until it exits, waits for input, fills its output
+// buffer or yields.
+static void session_resume(Session* s) {
+  RunStatus status = run_instance(&s->st, &s->old);
+  s->exited = status == RUN_EXIT;
+  s->yielded = status == RUN_YIELDED;
+  output_flush(&s->out);
+}
+
+// True if the session has exited and all its output has been written.
+static bool session_done(Session* s) {
+  return s->exited && !session_output_pending(s);
+}
+
+static Session* session_open(int fd, Cell* program, int features) {
+  Session* s = calloc(1, sizeof(Session));
+  if (!s)
+    errexit("Out of memory\n");
+  s->fd = fd;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  input_from_callback(&s->in, session_read, s);
+  output_init(&s->out, NULL, IO_BUFFER_SIZE, session_output_flush);
+  s->out.fd = fd;
+  run_init(&s->st, program, features, &s->in, &s->out);
+  s->st.slice = SESSION_SLICE;
+  return s;
+}
+
+static void session_close(Session* s) {
+  output_close(&s->out);
+  input_close(&s->in);
+  close(s->fd);
+  free_chunks(s->old.old_area);
+  free(s);
+}
+
+static void serve_sessions(const char* path, Cell* program, int features) {
+  freeze_program(&program, 1);
+  heap_chunk_size = SESSION_CHUNK_SIZE;
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0)
+    errexit("cannot create socket\n");
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    errexit("socket path too long: %s\n", path);
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 128) < 0)
+    errexit("cannot listen on %s\n", path);
+
+  int nsessions = 0, capacity = 16;
+  Session** sessions = malloc(sizeof(Session*) * capacity);
+  struct pollfd* fds = malloc(sizeof(struct pollfd) * (capacity + 1));
+  if (!sessions || !fds)
+    errexit("Out of memory\n");
+  long served = 0;
+
+  for (;;) {
+    fds[0].fd = listener;
+    fds[0].events = POLLIN;
+    bool yielded = false;  // some session can run without waiting
+    for (int i = 0; i < nsessions; i++) {
+      Session* s = sessions[i];
+      fds[i + 1].fd = s->fd;
+      fds[i + 1].events =
+        (s->exited || s->yielded || session_waits_for_output(s) ? 0 : POLLIN) |
+        (session_output_pending(s) ? POLLOUT : 0);
+      yielded |= s->yielded;
+    }
+    if (poll(fds, nsessions + 1, yielded ? 0 : -1) < 0)
+      continue;
+
+    // Sessions are resumed first, so that indices in fds stay valid.
+    for (int i = nsessions - 1; i >= 0; i--) {
+      Session* s = sessions[i];
+      short revents = fds[i + 1].revents;
+      if (!revents && !s->yielded)
+        continue;
+      if (session_output_pending(s))
+        output_flush(&s->out);
+      if (!s->exited && (s->yielded ||
+                         (session_waits_for_output(s)
+                          ? s->out.ptr < s->out.limit
+                          : (revents & (POLLIN | POLLHUP | POLLERR)) != 0)))
+        session_resume(s);
+      if (session_done(s)) {
+        session_close(s);
+        sessions[i] = sessions[--nsessions];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listener, NULL, NULL);
+      if (fd < 0)
+        continue;
+      if (nsessions == capacity) {
+        capacity *= 2;
+        sessions = realloc(sessions, sizeof(Session*) * capacity);
+        fds = realloc(fds, sizeof(struct pollfd) * (capacity + 1));
+        if (!sessions || !fds)
+          errexit("Out of memory\n");
+      }
+      Session* s = session_open(fd, program, features);
+      served++;
+      session_resume(s);
+      if (session_done(s))
+        session_close(s);
+      else
+        sessions[nsessions++] = s;
+      if (verbosity >= V_STATS)
+        fprintf(stderr, "session %ld started, %d active\n", served, nsessions);
+    }
+  }
+}
+
+// Pipes ---------------------------------------------------------------
+
+// With --pipe, several programs run in one process, each reading the output
+// of the one before. The stages are instances like sessions: they share the
+// nursery, so they take turns on one thread, and each has an old generation
+// of its own. Their output and input go through a ring buffer between them,
+// without system calls or locks. A stage suspends when @ finds its ring
+// empty, or . finds it full; the scheduler then runs the last stage that
+// can go on, so that data is consumed as soon as possible. The first stage
+// suspends rather than block on the standard input while the others can
+// run.
+
+#define PIPE_RING_SIZE (256*1024)
+
+typedef struct {
+  uint8_t buf[PIPE_RING_SIZE];
+  size_t head, tail;  // bytes read and written so far
+  bool closed;        // the writer has exited, and all its output is here
+  bool abandoned;     // the reader has exited
+} PipeRing;
+
+typedef struct {
+  RunState st;
+  OldGeneration old;
+  Input ring_in;
+  Output ring_out;
+  PipeRing *from, *to;  // NULL for the input and output of the pipeline
+  bool exited;
+  bool done;  // exited, and the output is delivered
+} PipeStage;
+
+static size_t ring_room(PipeRing* r) {
+  return PIPE_RING_SIZE - (r->tail - r->head);
+}
+
+static long pipe_read(void* ctx, uint8_t* buf, size_t size) {
+  PipeRing* r = ctx;
+  size_t n = r->tail - r->head;
+  if (n == 0)
+    return r->closed ? 0 : INPUT_PENDING;
+  if (n > size)
+    n = size;
+  size_t i = r->head % PIPE_RING_SIZE;
+  size_t first = n < PIPE_RING_SIZE - i ? n : PIPE_RING_SIZE - i;
+  memcpy(buf, r->buf + i, first);
+  memcpy(buf + first, r->buf, n - first);
+  r->head += n;
+  return n;
+}
+
+// Moves as much of the buffer as fits into the ring. If nothing does, the
+// buffer stays full and the stage suspends at its next output.
+static void pipe_output_flush(Output* out) {
+  PipeRing* r = out->ctx;
+  if (r->abandoned)
+    return;
+  size_t len = out->ptr - out->buf, n = len;
+  if (n > ring_room(r))
+    n = ring_room(r);
+  size_t i = r->tail % PIPE_RING_SIZE;
+  size_t first = n < PIPE_RING_SIZE - i ? n : PIPE_RING_SIZE - i;
+  memcpy(r->buf + i, out->buf, first);
+  memcpy(r->buf, out->buf + first, n - first);
+  r->tail += n;
+  memmove(out->buf, out->buf + n, len - n);
+  out->ptr = out->buf + (len - n);
+}
+
+static long pipe_stdin_fill(Input* in) {
+  struct pollfd pfd = {in->fd, POLLIN, 0};
+  if (poll(&pfd, 1, 0) == 0)
+    return INPUT_PENDING;
+  return fd_input_fill(in);
+}
+
+// True if resuming the stage can make progress. The first stage waiting
+// for the standard input is not.
+static bool pipe_stage_ready(PipeStage* s) {
+  if (s->done)
+    return false;
+  if (s->to && s->to->abandoned)
+    return true;
+  if (s->exited)
+    return ring_room(s->to);
+  if (!s->st.op)
+    return true;  // not started
+  if (s->st.op->t == DOT)
+    return ring_room(s->to);
+  return s->from && (s->from->tail > s->from->head || s->from->closed);
+}
+
+static void pipe_stage_resume(PipeStage* s) {
+  if (s->to && s->to->abandoned) {
+    // Like a process writing to a closed pipe, the stage is terminated.
+    s->exited = true;
+    s->ring_out.ptr = s->ring_out.buf;
+  } else if (!s->exited) {
+    s->exited = run_instance(&s->st, &s->old) == RUN_EXIT;
+  }
+  if (s->exited && s->from)
+    s->from->abandoned = true;
+  output_flush(s->st.out);
+  if (s->exited && (!s->to || s->ring_out.ptr == s->ring_out.buf)) {
+    s->done = true;
+    if (s->to)
+      s->to->closed = true;
+  }
+}
+
+static void run_pipe(Cell* programs[], int features[], int n,
+                     Input* in, Output* out) {
+  freeze_program(programs, n);
+  if (in->fill == fd_input_fill)
+    in->fill = pipe_stdin_fill;
+
+  PipeStage* stages = calloc(n, sizeof(PipeStage));
+  PipeRing* rings = calloc(n, sizeof(PipeRing));  // rings[i]: i to i + 1
+  if (!stages || !rings)
+    errexit("Out of memory\n");
+  for (int i = 0; i < n; i++) {
+    PipeStage* s = &stages[i];
+    Input* stage_in = in;
+    Output* stage_out = out;
+    if (i > 0) {
+      s->from = &rings[i - 1];
+      input_from_callback(&s->ring_in, pipe_read, s->from);
+      stage_in = &s->ring_in;
+    }
+    if (i < n - 1) {
+      s->to = &rings[i];
+      output_init(&s->ring_out, NULL, IO_BUFFER_SIZE, pipe_output_flush);
+      s->ring_out.ctx = s->to;
+      stage_out = &s->ring_out;
+    }
+    run_init(&s->st, programs[i], features[i], stage_in, stage_out);
+  }
+
+  for (;;) {
+    int i = n;
+    while (i-- > 0 && !pipe_stage_ready(&stages[i]))
+      ;
+    if (i < 0) {
+      if (stages[0].done)
+        break;
+      // Only the first stage can go on, once there is input.
+      struct pollfd pfd = {in->fd, POLLIN, 0};
+      poll(&pfd, 1, -1);
+      i = 0;
+    }
+    pipe_stage_resume(&stages[i]);
+  }
+
+  for (int i = 0; i < n; i++) {
+    free_chunks(stages[i].old.old_area);
+    if (stages[i].from)
+      input_close(&stages[i].ring_in);
+    if (stages[i].to)
+      output_close(&stages[i].ring_out);
+  }
+  free(stages);
+  free(rings);
+}
+
+// Output cache --------------------------------------------------------
+
+// With --cache, the output of a run is stored in a directory, in a file
+// named by the SHA-256 of the program text and the whole input. A later run
+// of the same program on the same input writes the stored output without
+// parsing or evaluating anything. Runs that fail are not stored, so a
+// stored output always comes with exit status 0. When the files take more
+// than the cache size, the least recently used ones (by modification time,
+// which hits update) are removed.
+
+#define CACHE_DEFAULT_SIZE 256  // in MB
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t block[64];
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(Sha256* sha, const uint8_t* p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ w[i - 15] >> 3;
+    uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ w[i - 2] >> 10;
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = sha->h[0], b = sha->h[1], c = sha->h[2], d = sha->h[3];
+  uint32_t e = sha->h[4], f = sha->h[5], g = sha->h[6], h = sha->h[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+      ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  sha->h[0] += a; sha->h[1] += b; sha->h[2] += c; sha->h[3] += d;
+  sha->h[4] += e; sha->h[5] += f; sha->h[6] += g; sha->h[7] += h;
+}
+
+static void sha256_init(Sha256* sha) {
+  static const uint32_t h0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(sha->h, h0, sizeof(h0));
+  sha->len = 0;
+}
+
+static void sha256_update(Sha256* sha, const uint8_t* p, size_t len) {
+  while (len) {
+    size_t used = sha->len % 64;
+    size_t n = len < 64 - used ? len : 64 - used;
+    memcpy(sha->block + used, p, n);
+    sha->len += n;
+    p += n;
+    len -= n;
+    if (sha->len % 64 == 0)
+      sha256_block(sha, sha->block);
+  }
+}
+
+// Stores the digest in hex into hex[65].
+static void sha256_final(Sha256* sha, char* hex) {
+  uint64_t bits = sha->len * 8;
+  uint8_t pad[72] = {0x80};
+  size_t npad = (sha->len % 64 < 56 ? 56 : 120) - sha->len % 64;
+  for (int i = 0; i < 8; i++)
+    pad[npad + i] = bits >> (56 - 8 * i);
+  sha256_update(sha, pad, npad + 8);
+  for (int i = 0; i < 8; i++)
+    sprintf(hex + 8 * i, "%08" PRIx32, sha->h[i]);
+}
+
+typedef struct {
+  const char* dir;
+  long long max_bytes;
+  char path[PATH_MAX];      // entry of this run
+  char tmp_path[PATH_MAX];  // written by a miss, renamed to path at the end
+  int fd;                   // of tmp_path
+} Cache;
+
+static Cache cache = {.fd = -1};
+
+// Stores the digest of the program text and the input in hex into hex[65].
+static void cache_key(const char* prog_file, const uint8_t* input,
+                      size_t input_len, char* hex) {
+  int fd = open(prog_file, O_RDONLY);
+  if (fd < 0)
+    errexit("cannot open %s\n", prog_file);
+  size_t len;
+  uint8_t* text = read_all(fd, &len);
+  close(fd);
+  Sha256 sha;
+  sha256_init(&sha);
+  uint8_t header[8];
+  for (int i = 0; i < 8; i++)
+    header[i] = (uint64_t)len >> (56 - 8 * i);
+  sha256_update(&sha, (const uint8_t*)"unlambda " VERSION, strlen("unlambda " VERSION) + 1);
+  sha256_update(&sha, header, 8);
+  sha256_update(&sha, text, len);
+  sha256_update(&sha, input, input_len);
+  sha256_final(&sha, hex);
+  free(text);
+}
+
+// Writes the stored output for the program and input to the standard output
+// and returns true, or returns false and starts recording the output of
+// this run.
+static bool cache_lookup(const char* dir, const char* prog_file,
+                         const uint8_t* input, size_t input_len) {
+  char hex[65];
+  cache_key(prog_file, input, input_len, hex);
+  cache.dir = dir;
+  snprintf(cache.path, sizeof(cache.path), "%s/%s", dir, hex);
+  int entry = open(cache.path, O_RDONLY);
+  if (entry >= 0) {
+    futimens(entry, NULL);  // most recently used
+    size_t len;
+    uint8_t* data = read_all(entry, &len);
+    close(entry);
+    write_all(STDOUT_FILENO, data, len);
+    free(data);
+    return true;
+  }
+  snprintf(cache.tmp_path, sizeof(cache.tmp_path), "%s/.tmp.XXXXXX", dir);
+  cache.fd = mkstemp(cache.tmp_path);
+  if (cache.fd < 0)
+    errexit("cannot create a file in %s: %s\n", dir, strerror(errno));
+  return false;
+}
+
+static void cache_write(const uint8_t* data, size_t len) {
+  if (cache.fd >= 0)
+    write_all(cache.fd, data, len);
+}
+
+// Standard output of a run that is being recorded.
+static void cache_tee(void* ctx, const uint8_t* data, size_t len) {
+  write_all(STDOUT_FILENO, data, len);
+  cache_write(data, len);
+}
+
+// Removes the output of a run that did not finish.
+static void cache_abandon() {
+  if (cache.fd >= 0) {
+    close(cache.fd);
+    unlink(cache.tmp_path);
+    cache.fd = -1;
+  }
+}
+
+typedef struct {
+  char name[65];
+  off_t size;
+  struct timespec mtime;
+} CacheEntry;
+
+static int compare_cache_entries(const void* a, const void* b) {
+  const struct timespec* x = &((const CacheEntry*)a)->mtime;
+  const struct timespec* y = &((const CacheEntry*)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Removes the least recently used entries until the cache fits its size.
+static void cache_evict() {
+  DIR* d = opendir(cache.dir);
+  if (!d)
+    return;
+  CacheEntry* entries = NULL;
+  size_t n = 0, size = 0;
+  long long total = 0;
+  struct dirent* de;
+  while ((de = readdir(d))) {
+    if (strlen(de->d_name) != 64 || strspn(de->d_name, "0123456789abcdef") != 64)
+      continue;
+    char path[PATH_MAX];
+    struct stat sb;
+    snprintf(path, sizeof(path), "%s/%s", cache.dir, de->d_name);
+    if (stat(path, &sb) < 0)
+      continue;  // removed by another process
+    if (n == size) {
+      size = size ? size * 2 : 256;
+      entries = realloc(entries, sizeof(CacheEntry) * size);
+      if (!entries)
+        errexit("Out of memory\n");
+    }
+    memcpy(entries[n].name, de->d_name, 65);
+    entries[n].size = sb.st_size;
+    entries[n].mtime = sb.st_mtim;
+    total += sb.st_size;
+    n++;
+  }
+  closedir(d);
+  qsort(entries, n, sizeof(CacheEntry), compare_cache_entries);
+  for (size_t i = 0; i < n && total > cache.max_bytes; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", cache.dir, entries[i].name);
+    unlink(path);
+    total -= entries[i].size;
+  }
+  free(entries);
+}
+
+// Stores the output of a run that finished.
+static void cache_commit() {
+  if (cache.fd < 0)
+    return;
+  close(cache.fd);
+  cache.fd = -1;
+  if (rename(cache.tmp_path, cache.path) < 0)
+    unlink(cache.tmp_path);
+  cache_evict();
+}
+
+// GC parameters -------------------------------------------------------
+
+// The sizes of the storage can be set at startup, with --gc or by a
+// configuration file named after the SHA-256 of the program, in the GC
+// directory (--gc-dir, by default ~/.config/unlambda/gc). --autotune writes
+// that file: it runs the program on the recorded standard input in child
+// processes, trying the candidates of one parameter at a time and keeping
+// the fastest (the one using least memory among close times).
+
+typedef struct {
+  const char* name;
+  long min, max;
+  int ncandidates;
+  long candidates[8];  // tried by --autotune
+} GcParam;
+
+static const GcParam gc_params[] = {
+  {"young-size", 16*1024, 64*1024*1024, 7,
+   {64*1024, 128*1024, 256*1024, 512*1024, 1024*1024, 2048*1024, 4096*1024}},
+  {"tenure-age", 0, 2, 3, {0, 1, 2}},
+  {"chunk-size", 1023, INT_MAX, 4, {16*1024-1, 64*1024-1, 256*1024-1, 1024*1024-1}},
+  {"growth-ratio", 1, 64, 4, {1, 2, 4, 8}},
+};
+
+#define NUM_GC_PARAMS (sizeof(gc_params) / sizeof(gc_params[0]))
+
+#define AUTOTUNE_RUNS 3        // of every configuration, the fastest counts
+#define AUTOTUNE_MARGIN 0.03   // closer times are ties, broken by memory
+
+static long gc_param_get(int i) {
+  switch (i) {
+  case 0: return young_size;
+  case 1: return tenure_age;
+  case 2: return heap_chunk_size;
+  default: return heap_growth_ratio;
+  }
+}
+
+static void gc_param_set(int i, long value) {
+  switch (i) {
+  case 0: young_size = value; break;
+  case 1: tenure_age = value; break;
+  case 2: heap_chunk_size = value; break;
+  default: heap_growth_ratio = value; break;
+  }
+}
+
+// Returns false if there is no such parameter, or the value is out of its
+// range.
+static bool gc_set(const char* name, long value) {
+  for (size_t i = 0; i < NUM_GC_PARAMS; i++) {
+    if (strcmp(name, gc_params[i].name) == 0) {
+      if (value < gc_params[i].min || value > gc_params[i].max)
+        return false;
+      gc_param_set(i, value);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sets the parameters of a list "name=value,...", as given to --gc.
+static void gc_parse(char* spec) {
+  for (char* p = strtok(spec, ","); p; p = strtok(NULL, ",")) {
+    char* eq = strchr(p, '=');
+    if (!eq)
+      errexit("bad GC parameter %s\n", p);
+    *eq = '\0';
+    if (!gc_set(p, atol(eq + 1)))
+      errexit("bad GC parameter %s=%s\n", p, eq + 1);
+  }
+}
+
+static void gc_format(char* buf, size_t size) {
+  size_t n = 0;
+  for (size_t i = 0; i < NUM_GC_PARAMS && n < size; i++)
+    n += snprintf(buf + n, size - n, "%s%s=%ld", i ? "," : "",
+                  gc_params[i].name, gc_param_get(i));
+}
+
+// Stores the path of the configuration of the program in path. Returns
+// false if there is no GC directory, without reading the program.
+static bool gc_config_path(const char* dir, const char* prog_file,
+                           char* path, size_t size, bool create) {
+  char dir_buf[PATH_MAX - 80];  // leaving room for the file name
+  if (!dir) {
+    const char* config = getenv("XDG_CONFIG_HOME");
+    const char* home = getenv("HOME");
+    if (config && *config)
+      snprintf(dir_buf, sizeof(dir_buf), "%s/unlambda/gc", config);
+    else if (home)
+      snprintf(dir_buf, sizeof(dir_buf), "%s/.config/unlambda/gc", home);
+    else
+      return false;
+    dir = dir_buf;
+  }
+  struct stat st;
+  if (create) {
+    // Every missing directory of the path
+    char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s/", dir);
+    for (char* p = buf + 1; *p; p++) {
+      if (*p == '/') {
+        *p = '\0';
+        mkdir(buf, 0755);
+        *p = '/';
+      }
+    }
+  }
+  if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+    return false;
+
+  int fd = open(prog_file, O_RDONLY);
+  if (fd < 0)
+    errexit("cannot open %s\n", prog_file);
+  size_t len;
+  uint8_t* text = read_all(fd, &len);
+  close(fd);
+  Sha256 sha;
+  char hex[65];
+  sha256_init(&sha);
+  sha256_update(&sha, text, len);
+  sha256_final(&sha, hex);
+  free(text);
+  snprintf(path, size, "%s/%s", dir, hex);
+  return true;
+}
+
+// Loads a configuration, lines "name value". Returns false if there is
+// none.
+static bool gc_load_config(const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (!fp)
+    return false;
+  char line[256], name[64];
+  long value;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "%63s %ld", name, &value) != 2 || !gc_set(name, value))
+      errexit("%s: bad line %s", path, line);
+  }
+  fclose(fp);
+  return true;
+}
+
+static long peak_memory() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;  // in KB
+}
+
+typedef struct {
+  double time;
+  long memory;  // peak RSS in KB, from the -v1 statistics
+  char output[65];  // SHA-256
+} Measurement;
+
+typedef struct {
+  char** args;  // the command line, args[2] being the --gc parameters
+  int input_fd;
+  char out_path[PATH_MAX], stats_path[PATH_MAX];
+} Tuning;
+
+static bool autotune_run(Tuning* t, Measurement* m) {
+  double start = wall_time();
+  pid_t pid = fork();
+  if (pid < 0)
+    errexit("fork failed: %s\n", strerror(errno));
+  if (pid == 0) {
+    int out = open(t->out_path, O_WRONLY | O_TRUNC);
+    int stats = open(t->stats_path, O_WRONLY | O_TRUNC);
+    lseek(t->input_fd, 0, SEEK_SET);
+    if (out < 0 || stats < 0 || dup2(t->input_fd, STDIN_FILENO) < 0 ||
+        dup2(out, STDOUT_FILENO) < 0 || dup2(stats, STDERR_FILENO) < 0)
+      _exit(127);
+    execv(t->args[0], t->args);
+    _exit(127);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  m->time = wall_time() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return false;
+
+  FILE* fp = fopen(t->stats_path, "r");
+  char line[256];
+  m->memory = -1;
+  while (fp && fgets(line, sizeof(line), fp))
+    sscanf(line, "  peak memory     --- %ld KB", &m->memory);
+  if (fp)
+    fclose(fp);
+  int fd = open(t->out_path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  size_t len;
+  uint8_t* output = read_all(fd, &len);
+  close(fd);
+  Sha256 sha;
+  sha256_init(&sha);
+  sha256_update(&sha, output, len);
+  sha256_final(&sha, m->output);
+  free(output);
+  return m->memory >= 0;
+}
+
+// Runs the program with the current parameters, printing the result.
+static bool autotune_measure(Tuning* t, Measurement* m) {
+  gc_format(t->args[2], 256);
+  fprintf(stderr, "  %-70s ", t->args[2]);
+  for (int i = 0; i < AUTOTUNE_RUNS; i++) {
+    Measurement run;
+    if (!autotune_run(t, &run)) {
+      fprintf(stderr, "failed\n");
+      return false;
+    }
+    if (i == 0 || run.time < m->time)
+      *m = run;
+  }
+  fprintf(stderr, "%7.3f sec %8ld KB\n", m->time, m->memory);
+  return true;
+}
+
+static bool better(const Measurement* a, const Measurement* b) {
+  return a->time < b->time * (1 - AUTOTUNE_MARGIN) ||
+    (a->time < b->time * (1 + AUTOTUNE_MARGIN) && a->memory < b->memory);
+}
+
+static int make_temp(char* path, const char* name) {
+  const char* tmpdir = getenv("TMPDIR");
+  snprintf(path, PATH_MAX, "%s/%s.XXXXXX", tmpdir ? tmpdir : "/tmp", name);
+  int fd = mkstemp(path);
+  if (fd < 0)
+    errexit("cannot create %s: %s\n", path, strerror(errno));
+  return fd;
+}
+
+// Tunes the parameters for prog_file and the standard input, and writes
+// them into the GC directory. The runs get the other options of argv.
+static void autotune(int argc, char* argv[], const char* prog_file,
+                     const char* dir) {
+  char path[PATH_MAX];
+  if (!gc_config_path(dir, prog_file, path, sizeof(path), true))
+    errexit("--autotune: cannot create the GC directory\n");
+
+  Tuning t;
+  char input_path[PATH_MAX];
+  t.input_fd = make_temp(input_path, "unlambda-input");
+  size_t len;
+  uint8_t* input = read_all(STDIN_FILENO, &len);
+  write_all(t.input_fd, input, len);
+  free(input);
+  close(make_temp(t.out_path, "unlambda-output"));
+  close(make_temp(t.stats_path, "unlambda-stats"));
+
+  char spec[256];
+  t.args = malloc(sizeof(char*) * (argc + 4));
+  if (!t.args)
+    errexit("Out of memory\n");
+  int n = 0;
+  t.args[n++] = access("/proc/self/exe", X_OK) == 0 ? "/proc/self/exe" : argv[0];
+  t.args[n++] = "--gc";
+  t.args[n++] = spec;
+  t.args[n++] = "-v1";
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--gc") == 0 || strcmp(argv[i], "--gc-dir") == 0)
+      i++;
+    else if (strcmp(argv[i], "--autotune") != 0 &&
+             !(argv[i][0] == '-' && argv[i][1] == 'v' && isdigit(argv[i][2])))
+      t.args[n++] = argv[i];
+  }
+  t.args[n] = NULL;
+
+  fprintf(stderr, "Tuning GC parameters for %s\n", prog_file);
+  Measurement first, best;
+  if (!autotune_measure(&t, &first))
+    errexit("--autotune: the program failed\n");
+  best = first;
+  for (size_t i = 0; i < NUM_GC_PARAMS; i++) {
+    long start = gc_param_get(i), chosen = start;
+    for (int j = 0; j < gc_params[i].ncandidates; j++) {
+      if (gc_params[i].candidates[j] == start)
+        continue;
+      gc_param_set(i, gc_params[i].candidates[j]);
+      Measurement m;
+      if (!autotune_measure(&t, &m))
+        continue;
+      if (strcmp(m.output, first.output) != 0) {
+        fprintf(stderr, "  (output differs, ignored)\n");
+        continue;
+      }
+      if (better(&m, &best)) {
+        best = m;
+        chosen = gc_params[i].candidates[j];
+      }
+    }
+    gc_param_set(i, chosen);
+  }
+  close(t.input_fd);
+  unlink(input_path);
+  unlink(t.out_path);
+  unlink(t.stats_path);
+  free(t.args);
+
+  char tmp_path[PATH_MAX + 8];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE* fp = fopen(tmp_path, "w");
+  if (!fp)
+    errexit("cannot create %s: %s\n", tmp_path, strerror(errno));
+  fprintf(fp, "# GC parameters tuned by --autotune for %s\n", prog_file);
+  fprintf(fp, "# %.3f sec, %ld KB (before: %.3f sec, %ld KB)\n",
+          best.time, best.memory, first.time, first.memory);
+  for (size_t i = 0; i < NUM_GC_PARAMS; i++)
+    fprintf(fp, "%s %ld\n", gc_params[i].name, gc_param_get(i));
+  if (fclose(fp) != 0 || rename(tmp_path, path) < 0)
+    errexit("cannot write %s\n", path);
+  gc_format(spec, sizeof(spec));
+  fprintf(stderr, "Best: %s\nSaved in %s\n", spec, path);
+}
+
+// Main ----------------------------------------------------------------
+
+void help(const char *progname) {
+  printf("Usage: %s [options] sourcefile\n", progname);
+  printf("  -h       print this help and exit\n");
+  printf("  -v       print version and exit\n");
+  printf("  -v[0-4]  set verbosity level (default: 0)\n");
+  printf("  -t<n>    promote program nodes after n evaluations, 0 for never (default: %d)\n",
+         DEFAULT_TIER_THRESHOLD);
+  printf("  -l       evaluate function definitions as lambda terms (experimental)\n");
+  printf("  -m       read all input before running and write output after it\n");
+  printf("  -p       start running the program while it is being parsed, untiered\n");
+  printf("  -j<n>    parse the program file with n threads, 0 for one per CPU (default: 1)\n");
+  printf("  --pipe prog1 prog2 ...\n");
+  printf("           run the programs in one process, piping each into the next\n");
+  printf("  --sessions path\n");
+  printf("           serve the program to every connection to the Unix socket,\n");
+  printf("           running the sessions in turns on one thread\n");
+  printf("  --lazy   parse parts of the program file when they are first run\n");
+  printf("  --ext lib.so\n");
+  printf("           load native combinators from a shared library\n");
+  printf("  --cache dir\n");
+  printf("           reuse the output of earlier runs on the same input, stored in dir\n");
+  printf("  --cache-size n\n");
+  printf("           keep at most n MB in the cache directory (default: %d)\n",
+         CACHE_DEFAULT_SIZE);
+  printf("  --spill dir\n");
+  printf("           map the old generation from a file in dir, to be paged out\n");
+  printf("  --gc name=value,...\n");
+  printf("           set GC parameters: young-size (cells), tenure-age (0-2),\n");
+  printf("           chunk-size (cells), growth-ratio\n");
+  printf("  --autotune\n");
+  printf("           find the best GC parameters for the program on this input,\n");
+  printf("           to be used for it from then on\n");
+  printf("  --gc-dir dir\n");
+  printf("           where tuned GC parameters are kept (default: ~/.config/unlambda/gc)\n");
+}
+
+
+static Output stdout_output;
+
+static void flush_stdout() {
+  output_flush(&stdout_output);
+}
+
+int main(int argc, char *argv[]) {
+  char *prog_file = NULL;
+  char *socket_path = NULL;
+  bool in_memory = false;
+  bool lambdas = false;
+  bool pipelined = false;
+  bool lazy = false;
+  char **pipe_files = NULL;
+  int num_pipe_files = 0;
+  char *cache_dir = NULL;
+  char *gc_spec = NULL;
+  char *gc_dir = NULL;
+  bool tune = false;
+  cache.max_bytes = CACHE_DEFAULT_SIZE * 1024LL * 1024;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-' && argv[i][1] == 'v' && isdigit(argv[i][2])) {
+      verbosity = argv[i][2] - '0';
+    } else if (argv[i][0] == '-' && argv[i][1] == 't' && isdigit(argv[i][2])) {
+      tier_threshold = atoi(&argv[i][2]);
+      if (tier_threshold == 0)
+        tier_threshold = UINT32_MAX;
+    } else if (argv[i][0] == '-' && argv[i][1] == 'j' && isdigit(argv[i][2])) {
+      parse_threads = atoi(&argv[i][2]);
+      if (parse_threads == 0)
+        parse_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (strcmp(argv[i], "-h") == 0) {
+      help(argv[0]);
+      return 0;
+    } else if (strcmp(argv[i], "-v") == 0) {
+      printf("Unlambda interpreter " VERSION " by irori\n");
+      return 0;
+    } else if (strcmp(argv[i], "-l") == 0) {
+      lambdas = true;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      in_memory = true;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      pipelined = true;
+    } else if (strcmp(argv[i], "--lazy") == 0) {
+      lazy = true;
+    } else if (strcmp(argv[i], "--pipe") == 0 && i + 1 < argc) {
+      pipe_files = &argv[i + 1];
+      num_pipe_files = argc - i - 1;
+      break;
+    } else if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--ext") == 0 && i + 1 < argc) {
+      ext_load(argv[++i]);
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+      cache.max_bytes = atoll(argv[++i]) * 1024 * 1024;
+    } else if (strcmp(argv[i], "--spill") == 0 && i + 1 < argc) {
+      spill_open(argv[++i]);
+    } else if (strcmp(argv[i], "--gc") == 0 && i + 1 < argc) {
+      gc_spec = argv[++i];
+    } else if (strcmp(argv[i], "--gc-dir") == 0 && i + 1 < argc) {
+      gc_dir = argv[++i];
+    } else if (strcmp(argv[i], "--autotune") == 0) {
+      tune = true;
+    } else if (argv[i][0] == '-') {
+      fprintf(stderr, "bad option %s  (Try -h for more information).\n", argv[i]);
+      return 1;
+    } else {
+      prog_file = argv[i];
+    }
+  }
+
+  // Extensions are bound in the complete tree, which -p and --lazy never
+  // build before running.
+  if (ext_libraries && (pipelined || lazy))
+    errexit("-p and --lazy cannot be used with --ext\n");
+
+  // The parameters tuned for the program, then --gc
+  char gc_path[PATH_MAX];
+  bool gc_tuned = prog_file && !pipe_files &&
+    gc_config_path(gc_dir, prog_file, gc_path, sizeof(gc_path), false) &&
+    gc_load_config(gc_path);
+  char gc_spec_copy[256];
+  if (gc_spec) {
+    snprintf(gc_spec_copy, sizeof(gc_spec_copy), "%s", gc_spec);
+    gc_parse(gc_spec_copy);
+  }
+  if (tune) {
+    if (!prog_file || pipe_files || socket_path || cache_dir)
+      errexit("--autotune needs a program file, and no --pipe, --sessions or --cache\n");
+    autotune(argc, argv, prog_file, gc_dir);
+    return 0;
+  }
+
+  Input in;
+  uint8_t* cache_input = NULL;
+  // The output of native combinators is not known from the program text.
+  if (cache_dir && prog_file && !socket_path && !pipe_files && !ext_libraries) {
+    size_t len;
+    cache_input = read_all(STDIN_FILENO, &len);
+    if (cache_lookup(cache_dir, prog_file, cache_input, len)) {
+      if (verbosity >= V_STATS)
+        fprintf(stderr, "  output cache    --- hit\n");
+      return 0;
+    }
+    atexit(cache_abandon);
+    input_from_memory(&in, cache_input, len);
+    output_to_callback(&stdout_output, cache_tee, NULL);
+  } else {
+    input_from_fd(&in, STDIN_FILENO);
+    output_to_fd(&stdout_output, STDOUT_FILENO);
+    in.tie = &stdout_output;
+  }
+  atexit(flush_stdout);
+
+  storage_init();
+  Cell* root;
+  int features;
+  Cell** pipe_roots = NULL;
+  int* pipe_features = NULL;
+  if (pipe_files) {
+    // The analyses need the node tables of tier_init(), sized for all the
+    // programs.
+    pipe_roots = malloc(sizeof(Cell*) * num_pipe_files);
+    pipe_features = malloc(sizeof(int) * num_pipe_files);
+    if (!pipe_roots || !pipe_features)
+      errexit("Out of memory\n");
+    for (int i = 0; i < num_pipe_files; i++)
+      pipe_roots[i] = bind_extensions(load_program(pipe_files[i], &in));
+    features = 0;
+    for (int i = 0; i < num_pipe_files; i++) {
+      pipe_features[i] = program_features(pipe_roots[i]);
+      features |= pipe_features[i];
+      if (lambdas)
+        recover_lambdas(pipe_roots[i]);
+    }
+    root = pipe_roots[0];
+  } else if (pipelined && !socket_path && !lambdas) {
+    // The tree is not complete yet, so it cannot be analyzed.
+    root = load_program_pipelined(prog_file, &in);
+    features = FEATURE_ALL;
+  } else if (lazy && prog_file && !socket_path && !lambdas) {
+    root = load_program_lazy(prog_file);
+    features = lazy_features();
+  } else {
+    root = bind_extensions(load_program(prog_file, &in));
+    features = program_features(root);
+    if (lambdas)
+      recover_lambdas(root);
+  }
+
+  if (socket_path && !pipe_files) {
+    serve_sessions(socket_path, root, features);
+    return 0;
+  }
+  if (!pipe_files)
+    memo_init();
+
+  // With -m, the program runs on memory buffers only, so that benchmarks
+  // measure the evaluator rather than system calls.
+  Input mem_in;
+  Output mem_out;
+  uint8_t* input_data = NULL;
+  if (in_memory) {
+    pipeline_finish(&in);
+    size_t buffered = in.end - in.ptr, len;
+    uint8_t* rest = read_all(STDIN_FILENO, &len);
+    input_data = malloc(buffered + len + 1);
+    if (!input_data)
+      errexit("Out of memory\n");
+    memcpy(input_data, in.ptr, buffered);
+    memcpy(input_data + buffered, rest, len);
+    free(rest);
+    input_from_memory(&mem_in, input_data, buffered + len);
+    output_to_memory(&mem_out, NULL, 0);
+  }
+
+  clock_t start = clock();
+  Input* run_in = in_memory ? &mem_in : &in;
+  Output* run_out = in_memory ? &mem_out : &stdout_output;
+  if (pipe_files) {
+    run_pipe(pipe_roots, pipe_features, num_pipe_files, run_in, run_out);
+  } else {
+    RunState st;
+    run_init(&st, root, features, run_in, run_out);
+    run(&st);
+  }
+  double evaltime = (clock() - start) / (double)CLOCKS_PER_SEC;
+
+  if (in_memory) {
+    write_all(STDOUT_FILENO, mem_out.buf, mem_out.ptr - mem_out.buf);
+    cache_write(mem_out.buf, mem_out.ptr - mem_out.buf);
+    output_close(&mem_out);
+    free(input_data);
+  }
+  output_flush(&stdout_output);
+  cache_commit();
+
+  if (verbosity >= V_STATS) {
+    fprintf(stderr, "  evaluator       --- %s%s%s%s\n",
+            features & FEATURE_D ? "d " : "", features & FEATURE_C ? "c " : "",
+            features & FEATURE_IO ? "@?| " : "",
+            features & FEATURE_E ? "e" : features ? "" : "pure");
+    if (parse_time)
+      fprintf(stderr, "  parse time      --- %5.2f sec.\n", parse_time);
+    fprintf(stderr, "  total eval time --- %5.2f sec.\n", evaltime - total_gc_time);
+    fprintf(stderr, "  total gc time   --- %5.2f sec.\n", total_gc_time);
+    fprintf(stderr, "  major gc count  --- %5" PRIu64 "\n", major_gc_count);
+    fprintf(stderr, "  minor gc count  --- %5" PRIu64 "\n", minor_gc_count);
+    fprintf(stderr, "  applications    --- %" PRIu64 "\n", applications);
+    fprintf(stderr, "  allocated       --- %" PRIu64 " bytes\n",
+            young_bytes + (free_ptr - EDEN));
+    fprintf(stderr, "  promoted        --- %" PRIu64 " cells\n", promoted_cells);
+    fprintf(stderr, "  peak memory     --- %ld KB\n", peak_memory());
+    if (gc_tuned || gc_spec) {
+      char params[256];
+      gc_format(params, sizeof(params));
+      fprintf(stderr, "  gc parameters   --- %s%s\n", params, gc_tuned ? " (tuned)" : "");
+    }
+    fprintf(stderr, "  old generation  --- %" PRIu64 " cells\n", old_cells());
+    fprintf(stderr, "  cells scanned   --- %" PRIu64 " (%.1fM/sec of gc time)\n",
+            total_scanned, total_gc_time ? total_scanned / total_gc_time / 1e6 : 0.0);
+    print_tier_stats();
+    if (lambdas)
+      fprintf(stderr, "  lambda subtrees --- %5ld\n", lambda_subtrees);
+    if (lazy_nodes)
+      fprintf(stderr, "  lazy nodes      --- %5ld of %u expanded\n",
+              lazy_expanded, num_nodes);
+    if (memo_values.n)
+      fprintf(stderr, "  memoized forces --- %5" PRIu64 " (%d promises)\n",
+              memo_hits, memo_values.n);
+    if (cache_input)
+      fprintf(stderr, "  output cache    --- miss\n");
+    if (ext_calls || ext_subtrees)
+      fprintf(stderr, "  native calls    --- %5" PRIu64 " (%ld subtrees replaced)\n",
+              ext_calls, ext_subtrees);
   }
   return 0;
 }
@@ -0,0 +1,57 @@
+// Unlambda interpreter - interface of native extensions
+//
+// Copyright (c) 2018 Kunihiko Sakamoto <irorin@gmail.com>
+// This code is licensed under the MIT License (see LICENSE file for details).
+
+// An extension is a shared library loaded with --ext. It exports
+//
+//   int unlambda_ext_init(const UnlambdaExt* api);
+//
+// which defines its combinators with api->define() and returns
+// UNLAMBDA_EXT_VERSION.
+//
+// A combinator is written $x in programs, x being its name, and can also
+// take the place of every subtree of the program equal to its pattern.
+// When it has been applied to as many arguments as its arity, its function
+// is called with them. The function returns an expression, which is
+// evaluated as the result of the application; it can be a value, such as
+// one of the arguments, or applications built with api->apply(), which are
+// evaluated from left to right as in a program.
+//
+// Cells are only valid until the function returns, and must not be kept.
+// The garbage collector never runs during the call, so the arguments and
+// the cells built by the api stay where they are.
+
+#ifndef UNLAMBDA_EXT_H
+#define UNLAMBDA_EXT_H
+
+#define UNLAMBDA_EXT_VERSION 1
+#define UNLAMBDA_EXT_MAX_ARITY 8
+
+typedef struct _Cell UnlCell;
+
+typedef UnlCell* (*UnlNative)(UnlCell* args[]);
+
+typedef struct {
+  // Defines $name, taking arity (1 to UNLAMBDA_EXT_MAX_ARITY) arguments.
+  // If pattern is not NULL, the subtrees of the program that are equal to
+  // it (an Unlambda expression, such as "``s`k`sik") are replaced with the
+  // combinator when the program is loaded. The pattern must not have
+  // effects, and must evaluate to a function that behaves like fn.
+  void (*define)(int name, int arity, UnlNative fn, const char* pattern);
+
+  // Builtins without arguments: i, k, s, v or r. The other builtins are
+  // not available, since the evaluator running the program may have been
+  // compiled without them.
+  UnlCell* (*builtin)(int name);
+  UnlCell* (*dot)(int ch);  // .ch
+  UnlCell* (*apply)(UnlCell* f, UnlCell* x);  // `fx
+
+  // Numbers in unary, `T`T..`Tx with n Ts, where ``Txy = `yx (as the
+  // program builds them with ``si`kx). number() returns n and stores x in
+  // *x; n is 0 for values that are not such chains.
+  unsigned long (*number)(UnlCell* c, UnlCell** x);
+  UnlCell* (*make_number)(unsigned long n, UnlCell* x);
+} UnlambdaExt;
+
+#endif